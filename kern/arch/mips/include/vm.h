@@ -30,6 +30,8 @@
 #ifndef _MIPS_VM_H_
 #define _MIPS_VM_H_
 
+#include <mips/tlb.h>
+
 
 /*
  * Machine-dependent VM system definitions.
@@ -117,13 +119,35 @@ paddr_t ram_getfirstfree(void);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	vaddr_t ts_start;	/* first page to invalidate */
+	unsigned int ts_npages;
+	uint32_t ts_tag;	/* address space the pages belong to */
 };
 
 #define TLBSHOOTDOWN_MAX 16
 
+/* Shootdowns of more pages than this scan the TLB instead of probing */
+#define TLBSHOOTDOWN_PROBE 8
+
+/*
+ * Per-CPU TLB bookkeeping. ts_tag names the address space whose
+ * entries the TLB holds, so switching back to it need not flush.
+ * ts_free is a stack of slots known to be invalid; once it is empty,
+ * refills replace entries round-robin from ts_victim. Only touched by
+ * its own CPU with interrupts off.
+ */
+struct tlbstate {
+	uint32_t ts_tag;
+	unsigned int ts_nfree;
+	uint8_t ts_free[NUM_TLB];
+	unsigned int ts_victim;
+	unsigned int ts_misses;		/* TLB miss faults */
+	unsigned int ts_refills;	/* entries written */
+	unsigned int ts_flushes;	/* whole-TLB flushes */
+	unsigned int ts_kept;		/* switches that kept the TLB */
+	struct cpu *ts_cpu;
+	struct tlbstate *ts_next;	/* all CPUs, for stats */
+};
+
 
 #endif /* _MIPS_VM_H_ */
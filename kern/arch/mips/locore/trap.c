@@ -112,6 +112,11 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
 		break;
 	}
 
+	/* a fault after the OOM killer picked us */
+	if (curproc->p_killed) {
+		proc_exit(_MKWAIT_SIG(SIGKILL));
+	}
+
 	/*
 	 * You will probably want to change this.
 	 */
@@ -119,9 +124,7 @@ kill_curthread(vaddr_t epc, unsigned code, vaddr_t vaddr)
 	sys__exit(code);
 	else
 	{
-		curproc->p_exitCode = _MKWAIT_SIG(sig);
-		V(curproc->p_exitSem);
-		thread_exit();
+		proc_exit(_MKWAIT_SIG(sig));
 	}
 	kprintf("Fatal user mode trap %u sig %d (%s, epc 0x%x, vaddr 0x%x)\n",
 		code, sig, trapcodenames[code], epc, vaddr);
@@ -206,6 +209,17 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * A killed process that never traps on its own dies here:
+		 * restore the interrupt state the way the trap path does
+		 * below and take the same exit at done.
+		 */
+		if (!iskern && curproc->p_killed) {
+			spl = splhigh();
+			splx(spl);
+			goto done;
+		}
 		goto done2;
 	}
 
@@ -326,6 +340,14 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/*
+	 * A process the OOM killer picked dies on its way back to user
+	 * mode, where it holds no locks.
+	 */
+	if (!iskern && curproc->p_killed) {
+		proc_exit(_MKWAIT_SIG(SIGKILL));
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -105,6 +105,7 @@ syscall(struct trapframe *tf)
 	int whence = 0;
     off_t position = 0;
 	int32_t retval2 = 0; 
+	int fd = 0;
 
 	switch (callno) {
 	    case SYS_reboot:
@@ -174,6 +175,22 @@ syscall(struct trapframe *tf)
 		case SYS_sbrk:
 		err=(int)sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)&retval);
 		break;
+
+		case SYS_mmap:
+		/* fd and the 64-bit offset are passed on the stack */
+		err = copyin((const userptr_t)tf->tf_sp+16, &fd, sizeof(fd));
+		if (err)
+			break;
+		err = copyin((const userptr_t)tf->tf_sp+24, &position, sizeof(position));
+		if (err)
+			break;
+		err = sys_mmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1, (int)tf->tf_a2,
+			       (int)tf->tf_a3, fd, position, (vaddr_t *)&retval);
+		break;
+
+		case SYS_munmap:
+		err = sys_munmap((vaddr_t)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = ENOSYS;
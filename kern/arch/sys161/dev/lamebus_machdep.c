@@ -76,6 +76,40 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+/*
+ * The fewest cycles ahead we set the timer, so that it does not go
+ * by before the mtc0 is done.
+ */
+#define MIPS_TIMER_MIN	100
+
+void
+mainbus_timer_set(uint32_t nsecs)
+{
+	uint32_t cycles;
+
+	cycles = nsecs / (1000000000 / CPU_FREQUENCY);
+	if (cycles < MIPS_TIMER_MIN) {
+		cycles = MIPS_TIMER_MIN;
+	}
+	mips_timer_set(mips_timer_get() + cycles);
+}
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -114,9 +148,10 @@ mainbus_bootstrap(void)
 	autoconf_lamebus(lamebus, 0);
 
 	/*
-	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
+	 * Start the MIPS on-chip timer. It is set afresh on each
+	 * interrupt, for the next hardclock or timer; see clock.c.
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	clock_start();
 }
 
 /*
@@ -314,10 +349,8 @@ mainbus_interrupt(struct trapframe *tf)
 		seen = true;
 	}
 	if (cause & MIPS_TIMER_BIT) {
-		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
-		/* and call hardclock */
-		hardclock();
+		/* Run timers and hardclock; this also resets the timer */
+		clock_interrupt();
 		seen = true;
 	}
 
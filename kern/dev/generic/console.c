@@ -142,7 +142,9 @@ getch_intr(struct con_softc *cs)
 {
 	unsigned char ret;
 
+	thread_iowait(true);
 	P(cs->cs_rsem);
+	thread_iowait(false);
 	ret = cs->cs_gotchars[cs->cs_gotchars_tail];
 	cs->cs_gotchars_tail =
 		(cs->cs_gotchars_tail + 1) % CONSOLE_INPUT_BUFFER_SIZE;
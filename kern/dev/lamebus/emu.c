@@ -850,8 +850,9 @@ static
 int
 emufs_mmap(struct vnode *v)
 {
+	/* pages are read and written back through VOP_READ/VOP_WRITE */
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 //////////////////////////////
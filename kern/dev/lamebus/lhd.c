@@ -37,6 +37,7 @@
 #include <uio.h>
 #include <membar.h>
 #include <synch.h>
+#include <thread.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -238,7 +239,9 @@ lhd_io(struct device *d, struct uio *uio)
 		lhd_wreg(lh, LHD_REG_STAT, statval);
 
 		/* Now wait until the interrupt handler tells us we're done. */
+		thread_iowait(true);
 		P(lh->lh_done);
+		thread_iowait(false);
 
 		/* Get the result value saved by the interrupt handler. */
 		result = lh->lh_result;
@@ -232,14 +232,15 @@ sfs_fsync(struct vnode *v)
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Mapped pages are filled and written back with
+ * VOP_READ and VOP_WRITE, so any regular file can be mapped.
  */
 static
 int
 sfs_mmap(struct vnode *v   /* add stuff as needed */)
 {
 	(void)v;
-	return ENOSYS;
+	return 0;
 }
 
 /*
@@ -36,16 +36,52 @@
 
 
 #include <vm.h>
+#include <array.h>
 
 struct vnode;
 
+/* Region permissions */
+#define REG_READ   0x4
+#define REG_WRITE  0x2
+#define REG_EXEC   0x1
+
+/* Region types */
+#define REGION_SEGMENT  0     /* loaded from the executable */
+#define REGION_HEAP     1
+#define REGION_STACK    2
+#define REGION_MMAP     3
+
+/* Largest the user stack may grow, in pages */
+#define STACK_PAGES  3000
+
+/*
+ * Largest a heap may grow, in pages. New processes get vm_heaplimit
+ * as their limit (as->heap_max); children inherit their parent's.
+ */
+#define HEAP_PAGES_DEFAULT  16384
+extern unsigned int vm_heaplimit;
+
 struct region {
   vaddr_t reg_start;
   vaddr_t reg_end;
   size_t npages;
-  struct region *next_region;
+  int reg_type;
+  int reg_perms;
+  struct vnode *reg_vnode;      /* file behind an mmap region, or NULL */
+  off_t reg_offset;             /* file offset of reg_start */
+  bool reg_shared;              /* MAP_SHARED: writes go back to the file */
 };
 
+/* Where regions come from; set up by vm_bootstrap. */
+extern struct objcache *region_cache;
+
+#ifndef ASINLINE
+#define ASINLINE INLINE
+#endif
+
+DECLARRAY(region, ASINLINE);
+DEFARRAY(region, ASINLINE);
+
 struct addrspace {
 #if OPT_DUMBVM
   vaddr_t as_vbase1;
@@ -56,29 +92,51 @@ struct addrspace {
   size_t as_npages2;
   paddr_t as_stackvbase;
 #else
-  struct region *regions;
+  struct regionarray *regions;  /* every region, sorted by reg_start */
+  struct region *last_region;   /* last one as_find_region found */
+  vaddr_t last_fault;           /* for spotting sequential access */
   struct first_level_page_table* first;
   struct region *heap;
-  vaddr_t stack_top;
-  vaddr_t stack_bottom;
+  struct region *stack;
+  unsigned int heap_max;        /* sbrk limit, in pages */
+  unsigned int rss;             /* resident pages, shared ones included */
+  unsigned int swapped;         /* pages out in swap */
+  unsigned int pt_pages;        /* second-level page tables */
+  bool loading;         /* between as_prepare_load and as_complete_load */
+  uint32_t tlb_tag;     /* names this address space's TLB entries */
+  volatile uint32_t tlb_cpus;   /* CPUs that may hold entries under tlb_tag */
 #endif
 };
 
-struct page_table_entry {
-  paddr_t base;
-  unsigned is_valid:1;
+/*
+ * Page table entries are packed words. The top 20 bits hold the frame
+ * address, or the swap slot number when PTE_SWAPPED is set. A zero
+ * entry maps nothing.
+ */
+typedef uint32_t pte_t;
 
-};
+#define PTE_FRAME	0xfffff000
+#define PTE_VALID	0x00000001	/* frame is resident */
+#define PTE_DIRTY	0x00000002	/* written since it was last paged in */
+#define PTE_REFERENCED	0x00000004	/* clock bit, set on every fault */
+#define PTE_READONLY	0x00000008	/* frame shared copy-on-write */
+#define PTE_SWAPPED	0x00000010	/* contents are in swap */
+#define PTE_MIGRATING	0x00000020	/* frame being moved; wait for it */
+#define PTE_MODIFIED	0x00000040	/* shared file page written since read */
+
+#define PTE_SLOT(pte)		((pte) >> 12)
+#define PTE_MKSLOT(slot)	((pte_t)(slot) << 12)
+
+#define PT1_INDEX(vaddr)	((vaddr) >> 22)
+#define PT2_INDEX(vaddr)	(((vaddr) & 0x003FFFFF) >> 12)
 
 struct second_level_page_table {
-  struct page_table_entry *actual_pages[1024];
+  pte_t entries[1024];
 };
 
 struct first_level_page_table {
   struct second_level_page_table *second_levels[1024];
 };
-enum direction_alloc {  POSITIVE, NEGATIVE } ;
-
 struct addrspace *as_create(void);
 
 int as_copy(struct addrspace *src, struct addrspace **ret);
@@ -95,6 +153,12 @@ int as_define_region(struct addrspace *as,
            int writeable,
            int executable);
 
+int as_define_text(struct addrspace *as,
+           vaddr_t vaddr, size_t sz,
+           int readable,
+           int executable,
+           struct vnode *vn, off_t offset);
+
 int as_prepare_load(struct addrspace *as);
 
 int as_complete_load(struct addrspace *as);
@@ -103,11 +167,26 @@ int as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
 
 int load_elf(struct vnode *v, vaddr_t *entrypoint);
 
-int alloc_region(struct first_level_page_table *first, vaddr_t vaddr, size_t npages, enum direction_alloc direction);
+struct region *as_find_region(struct addrspace *as, vaddr_t vaddr);
+
+bool as_range_free(struct addrspace *as, vaddr_t start, vaddr_t end);
+
+int as_define_mmap(struct addrspace *as, vaddr_t *addr, size_t len,
+           int perms, bool fixed,
+           struct vnode *vn, off_t offset, bool shared);
+
+int as_unmap(struct addrspace *as, vaddr_t addr, size_t len);
+
+pte_t *alloc_pte(struct addrspace *as, vaddr_t vaddr);
+
+pte_t *find_pte(struct first_level_page_table *first, vaddr_t vaddr);
+
+int pte_share(pte_t *old, pte_t *new, struct addrspace *newas, vaddr_t vaddr);
 
-void dealloc_pt(struct first_level_page_table *first, vaddr_t vaddr);
+void pte_release(struct addrspace *as, vaddr_t vaddr, pte_t *pte);
 
-struct page_table_entry *find_pte(struct first_level_page_table *first, vaddr_t vaddr);
+unsigned int pte_release_range(struct addrspace *as, vaddr_t start,
+           unsigned int npages);
 
 
 
@@ -45,9 +45,63 @@
 /* hardclocks per second */
 #define HZ  100
 
+#define NS_PER_SEC		1000000000
+#define NS_PER_HARDCLOCK	(NS_PER_SEC / HZ)
+
 void hardclock_bootstrap(void);
 void hardclock(void);
 
+/*
+ * Each cpu's timer interrupt is one-shot: clock_interrupt(), called
+ * by the machine-dependent code, runs the cpu's expired timers, calls
+ * hardclock() if a tick is due, and sets the next interrupt for
+ * whichever comes first. While a cpu is idle it takes no hardclocks
+ * at all (clock_idle_enter/clock_idle_exit, from the idle loop), only
+ * the interrupts its timers need.
+ *
+ * clock_start() is called by the machine-dependent code once the
+ * devices are attached and clock_ns() can be read; until then the
+ * timer interrupt just runs hardclock().
+ */
+struct cpu;
+void clock_cpu_init(struct cpu *c);
+void clock_start(void);
+void clock_interrupt(void);
+void clock_idle_enter(void);
+void clock_idle_exit(void);
+void clock_printstats(void);
+
+/*
+ * clock_ns() is the time in nanoseconds, read from the realtime clock
+ * (the ltimer), so it is the same on all cpus.
+ */
+uint64_t clock_ns(void);
+
+/*
+ * High-resolution timers. When clock_ns() reaches a timer's deadline,
+ * TM_FUNC(TM_DATA) is called in interrupt context on the cpu the
+ * timer was added on. Each cpu keeps its timers in a heap ordered by
+ * deadline.
+ *
+ * timer_add must be called from a thread, as it may need to grow the
+ * heap; it fails only with ENOMEM. A timer can be added again once
+ * it has fired or been cancelled. timer_cancel returns true if it
+ * stopped the timer; false means the function has run or is running.
+ */
+struct timer {
+	uint64_t tm_deadline;
+	void (*tm_func)(void *data);
+	void *tm_data;
+	struct cpu *tm_cpu;		/* whose heap it is on */
+	unsigned tm_index;		/* where, or TIMER_IDLE */
+};
+
+#define TIMER_IDLE ((unsigned)-1)
+
+void timer_init(struct timer *tm, void (*func)(void *), void *data);
+int timer_add(struct timer *tm, uint64_t deadline);
+bool timer_cancel(struct timer *tm);
+
 /*
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -79,5 +133,11 @@ void timespec_sub(const struct timespec *t1,
  */
 void clocksleep(int seconds);
 
+/*
+ * thread_sleep_until() suspends the current thread until clock_ns()
+ * reaches DEADLINE. Fails only with ENOMEM.
+ */
+int thread_sleep_until(uint64_t deadline);
+
 
 #endif /* _CLOCK_H_ */
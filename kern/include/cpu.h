@@ -34,6 +34,9 @@
 #include <spinlock.h>
 #include <threadlist.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
+#include <vm.h>		/* for struct pagecache */
+
+struct timer;	/* from <clock.h> */
 
 extern unsigned num_cpus;
 
@@ -62,6 +65,8 @@ struct cpu {
 	struct threadlist c_zombies;	/* List of exited threads */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	unsigned c_steals;		/* Threads taken from other cpus */
+	unsigned c_stealtries;		/* Times this cpu looked for one */
 
 	/*
 	 * Accessed by other cpus.
@@ -70,6 +75,7 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	unsigned c_stolen;		/* Threads taken by other cpus */
 
 	/*
 	 * Accessed by other cpus.
@@ -89,6 +95,35 @@ struct cpu {
 	unsigned c_numshootdown;
 	struct spinlock c_ipi_lock;
 
+	/*
+	 * Free page cache. Normally used only by this cpu; other cpus
+	 * take pc_lock to drain it when memory runs out.
+	 */
+	struct pagecache c_pagecache;
+
+	/* kmalloc magazines; likewise. */
+	struct kmcache c_kmcache;
+
+	/* TLB contents and stats; see vm.c. */
+	struct tlbstate c_tlb;
+
+	/*
+	 * Timers and ticks; see clock.c. The timer heap is protected
+	 * by c_timer_lock, as other cpus can cancel timers on it and
+	 * grow it; the rest is accessed only by this cpu.
+	 */
+	struct spinlock c_timer_lock;
+	struct timer **c_timers;	/* heap of pending timers */
+	unsigned c_ntimers;
+	unsigned c_maxtimers;
+	unsigned c_timersfired;
+	uint64_t c_nexttick;		/* clock_ns() when hardclock is due */
+	bool c_tickless;		/* idle, and taking no hardclocks */
+	uint64_t c_idlestart;		/* clock_ns() when that started */
+	unsigned c_idleperiods;
+	unsigned c_ticksskipped;	/* hardclocks not taken while idle */
+	struct cpu *c_clocknext;	/* list of all cpus in clock.c */
+
 	/*
 	 * Accessed by other cpus. Protected inside hangman.c.
 	 */
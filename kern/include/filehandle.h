@@ -17,6 +17,7 @@ struct filehandle
 	struct lock* fh_lock;
 };
 
+void fh_bootstrap(void);
 struct filehandle * fh_create(const char *name, struct vnode *vnode);
 int fh_assign(struct filehandle* fh);
 void fh_destroy(struct filehandle *fh);
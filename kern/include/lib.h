@@ -125,6 +125,16 @@ uint32_t random(void);
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
  * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ *
+ * kheap_reclaim returns blocks cached per cpu to the heap pages, so
+ * that pages holding nothing else can be freed.
+ *
+ * kheap_printfrag reports how much of the heap's memory is free or
+ * lost to rounding, and the sizes asked for.
+ *
+ * kheap_printprofile reports the allocation sites seen by the sampling
+ * profiler; kheap_setsamplerate sets how many allocations there are
+ * per sample (0 turns it off) and starts the profile over.
  */
 void *kmalloc(size_t size);
 void kfree(void *ptr);
@@ -134,6 +144,10 @@ unsigned long kheap_getused(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_reclaim(void);
+void kheap_printfrag(void);
+void kheap_printprofile(void);
+void kheap_setsamplerate(unsigned rate);
 
 /*
  * C string functions.
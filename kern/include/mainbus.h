@@ -52,6 +52,13 @@ void mainbus_interrupt(struct trapframe *);
 /* XXX this interface is not adequately MI */
 size_t mainbus_ramsize(void);
 
+/*
+ * Set the current cpu's timer to interrupt NSECS nanoseconds from
+ * now, or as soon as it can if that is too soon. Replaces any earlier
+ * setting, and clears a pending timer interrupt.
+ */
+void mainbus_timer_set(uint32_t nsecs);
+
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Object caches: allocators for one kind of object, carved out of
+ * whole pages. See vm/objcache.c.
+ *
+ * CTOR, if not NULL, runs once when an object's memory is first set
+ * up and returns an error code; DTOR runs when the memory goes back
+ * to the page allocator. In between, objects keep whatever CTOR set
+ * up: objcache_alloc hands out an object as it was last freed, and
+ * objcache_free must be given one in the state CTOR left it in.
+ *
+ * NAME should be a string constant.
+ */
+
+struct objcache;	/* Opaque. */
+
+struct objcache *objcache_create(const char *name, size_t size,
+				 int (*ctor)(void *obj),
+				 void (*dtor)(void *obj));
+void objcache_destroy(struct objcache *oc);
+
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+
+/* Give slabs with no objects in use back to the page allocator. */
+void objcache_reap(void);
+
+void objcache_printstats(void);
+
+#endif /* _OBJCACHE_H_ */
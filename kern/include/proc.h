@@ -81,6 +81,7 @@ struct proc {
 	pid_t p_pid;
 	pid_t p_parentpid;
 	int p_state;
+	volatile bool p_killed;		/* picked by the OOM killer */
     int p_exitCode; //EXITED 0, RUNNING 1
     struct semaphore * p_exitSem;
 
@@ -112,5 +113,11 @@ struct addrspace *proc_getas(void);
 /* Change the address space of the current process, and return the old one. */
 struct addrspace *proc_setas(struct addrspace *);
 
+/* Choose and mark a process to kill when out of memory. */
+struct proc *proc_oomselect(bool *pending);
+
+/* Print per-process memory use. */
+void proc_printmem(void);
+
 
 #endif /* _PROC_H_ */
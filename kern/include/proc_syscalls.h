@@ -14,5 +14,9 @@ int sys_fork(struct trapframe* parent_tf, int *retVal);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retVal);
 int sys_execv(const char *progname, char **args);
 void sys__exit(int exitcode);
+__DEAD void proc_exit(int status);
 void *sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, vaddr_t *retval);
+int sys_munmap(vaddr_t addr, size_t len);
 #endif
@@ -116,6 +116,8 @@ int kmallocstress(int, char **);
 int kmalloctest3(int, char **);
 int kmalloctest4(int, char **);
 int kmalloctest5(int, char **);
+int coremapbench(int, char **);
+int timertest(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
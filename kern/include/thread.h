@@ -56,6 +56,17 @@ struct cpu;
 /* Macro to test if two addresses are on the same kernel stack */
 #define SAME_STACK(p1, p2)     (((p1) & STACK_MASK) == ((p2) & STACK_MASK))
 
+/*
+ * Scheduler. Threads run from a multi-level feedback queue: level 0
+ * is the highest priority. A thread that uses up its quantum at a
+ * level drops to the next; one that waits on a device, or waits too
+ * long on the run queue, is raised again. sched_quantum[] holds the
+ * quantum of each level, in hardclocks.
+ */
+#define SCHED_NLEVELS 4
+
+extern unsigned sched_quantum[SCHED_NLEVELS];
+
 
 /* States a thread can be in. */
 typedef enum {
@@ -93,8 +104,25 @@ struct thread {
 	struct switchframe *t_context;	/* Saved register context (on stack) */
 	struct cpu *t_cpu;		/* CPU thread runs on */
 	struct proc *t_proc;		/* Process thread belongs to */
+	struct threadlistnode t_allnode; /* Link for the list of all threads */
 	HANGMAN_ACTOR(t_hangman);	/* Deadlock detector hook */
 
+	/*
+	 * Scheduler fields. t_level and t_quantum are changed with
+	 * the thread's cpu's run queue locked, or by the thread itself
+	 * while it runs. The counters are in hardclocks and are only
+	 * for reporting.
+	 */
+	unsigned t_level;		/* MLFQ level; 0 is highest */
+	unsigned t_quantum;		/* Hardclocks left at this level */
+	bool t_iowait;			/* Sleeping for a device */
+	unsigned t_readystamp;		/* c_hardclocks when made runnable */
+	unsigned t_runticks;		/* Hardclocks spent running */
+	unsigned t_waitticks;		/* Hardclocks spent runnable */
+	unsigned t_runs;		/* Times picked to run */
+	unsigned t_ioboosts;		/* Times raised after device waits */
+	unsigned t_migrations;		/* Times moved to another cpu */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -174,10 +202,20 @@ void thread_yield(void);
 void schedule(void);
 
 /*
- * Potentially migrate ready threads to other CPUs. Called from the
- * timer interrupt.
+ * Charge a hardclock to the current thread. Returns true if it should
+ * give up the cpu, because its quantum is used or something of higher
+ * priority is waiting.
  */
-void thread_consider_migration(void);
+bool thread_tick(void);
+
+/*
+ * Bracket a wait for a device (thread_iowait(true) before, false
+ * after) so that the scheduler raises the thread when it wakes.
+ */
+void thread_iowait(bool waiting);
+
+/* Print the scheduler's per-thread accounting. */
+void thread_printsched(void);
 
 extern unsigned thread_count;
 void thread_wait_for_count(unsigned);
@@ -38,6 +38,10 @@
 
 
 #include <machine/vm.h>
+#include <spinlock.h>
+
+struct cpu;
+struct addrspace;
 
 /* Fault-type arguments to vm_fault() */
 #define VM_FAULT_READ        0    /* A read was attempted */
@@ -55,27 +59,273 @@ void free_kpages(vaddr_t addr);
 
 unsigned int coremap_used_bytes(void);
 
+bool vm_copypage(struct addrspace *as, vaddr_t vaddr, void *buf,
+		 bool *modified);
+
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Per-CPU TLB management */
+void tlbstate_init(struct cpu *c);
+void tlbstate_printstats(void);
+void vm_tlbactivate(struct addrspace *as);
+void vm_tlbretag(struct addrspace *as);
+
+/*
+ * Fault-around: after a fault, also enter up to vm_faultaround resident
+ * neighbouring pages into free TLB slots, and when anonymous memory is
+ * being touched sequentially, allocate up to vm_prefault pages ahead of
+ * the fault. Either can be set to 0 to turn it off.
+ */
+#define FAULTAROUND_DEFAULT	8
+#define PREFAULT_DEFAULT	4
+#define PREFAULT_MAX		32	/* largest vm_prefault the menu accepts */
+#define PREFAULT_MIN_FREE	128	/* free pages needed to prefault */
+
+extern unsigned int vm_faultaround;
+extern unsigned int vm_prefault;
+
+/*
+ * Superpages. The TLB only maps 4K pages, so a superpage here is a
+ * naturally aligned block of SUPERPAGE_PAGES frames taken from the
+ * buddy lists in one piece and mapped in full on the first touch of
+ * any page in it. Used for anonymous writable memory when a free block
+ * is at hand and more than SUPERPAGE_MIN_FREE pages are free. After
+ * that the frames are ordinary pages, paged out and freed one by one.
+ */
+#define SUPERPAGE_ORDER		4
+#define SUPERPAGE_PAGES		(1u << SUPERPAGE_ORDER)
+#define SUPERPAGE_SIZE		(SUPERPAGE_PAGES * PAGE_SIZE)
+#define SUPERPAGE_MIN_FREE	256
+
+extern bool vm_superpages;
+
+void vm_faultstats(void);
+void vm_faultstats_reset(void);
+
+/*
+ * Memory pressure, from the count of free pages against watermarks
+ * set at boot as fractions of physical memory. Below the low mark the
+ * state goes to LOW, which turns off prefaulting and superpages; it
+ * goes back to NONE above the high mark. CRITICAL means a user page
+ * could not be had even by paging out. The fault then kills the
+ * process using the most memory and retries, up to OOM_RETRIES times,
+ * rather than failing.
+ */
+enum vm_pressure {
+	VM_PRESSURE_NONE, VM_PRESSURE_LOW, VM_PRESSURE_CRITICAL
+};
+
+#define PRESSURE_LOW_FRACTION	16	/* low mark: 1/16 of memory free */
+#define PRESSURE_HIGH_FRACTION	8	/* high mark: 1/8 */
+#define OOM_RETRIES		5
+
+extern volatile enum vm_pressure vm_pressure;
+
+/*
+ * Compaction. When no free block is big enough, the aligned block that
+ * needs fewest moves is cleared by copying its user pages to frames
+ * elsewhere; the reverse map says which page table entries to fix.
+ * While a page is being moved its entries are PTE_MIGRATING and
+ * anything that finds one waits in vm_pager_barrier().
+ */
+bool vm_compact(int order);
+void vm_fragstats(void);
+void vm_pager_barrier(void);
+
+void vm_printmem(void);
+void vm_dumpcoremap(unsigned int first, unsigned int count);
+void vm_tlbshootdown_range(struct addrspace *as, vaddr_t start,
+			   unsigned int npages);
+
 enum page_state {
 	FIXED, FREE, DIRTY, CLEAN
 };
 
+/*
+ * Physical pages are handed out by a binary buddy allocator that lives
+ * in the coremap itself. A free block of 2^order pages is represented
+ * by its first entry, which records the order and is linked into the
+ * free list for that order; the other entries of the block have
+ * order == CM_NOORDER. Links are coremap indices, CM_NONE terminates.
+ */
+#define CM_MAX_ORDER	12		/* largest block: 2^12 pages (16M) */
+#define CM_NOORDER	(-1)
+#define CM_NONE		0xffffffff
+
+/*
+ * Reverse map. A mapped user frame's first mapping is the (as, vaddr)
+ * in its coremap entry; every further one (copy-on-write after fork,
+ * a shared file page) is on its sharers list, so refcount is one more
+ * than the length of the list. When the first mapping goes, the head
+ * of the list takes its place.
+ */
+struct cm_sharer {
+	struct addrspace *sh_as;
+	vaddr_t sh_vaddr;
+	struct cm_sharer *sh_next;
+};
+
 struct cm_listing {
 	enum page_state state;
-	unsigned int page_count;
+	unsigned int page_count;	/* pages in the allocation starting here */
+	unsigned int refcount;		/* address spaces sharing a user page */
+	int order;			/* order of the free block starting here */
+	unsigned int next_free;		/* free list links */
+	unsigned int prev_free;
+
+	/*
+	 * Paging. A user page can be evicted only while (as, vaddr) is
+	 * its only mapping and it is not busy. swap_slot is the slot that
+	 * holds a copy of the page (CLEAN) or that it was last paged in
+	 * from (DIRTY), or CM_NONE.
+	 */
+	struct addrspace *as;
+	vaddr_t vaddr;
+	struct cm_sharer *sharers;	/* other mappings */
+	unsigned int swap_slot;
+	bool busy;			/* being evicted or not yet mapped */
+	bool zeroed;			/* free page known to hold only zeroes */
+	unsigned char km_tag;		/* see kpage_settag */
+
+	/*
+	 * Read-only file pages are shared through the file cache,
+	 * hashed on (fc_vnode, fc_offset). fc_vnode is NULL for pages
+	 * not in it. Whoever maps the page holds a reference on the
+	 * vnode through its region, so the cache does not.
+	 */
+	struct vnode *fc_vnode;
+	off_t fc_offset;
+	unsigned int fc_next;		/* hash chain */
 };
 
 void cm_bootstrap(void);
 
-paddr_t allocate_one_page(int type); 
+/*
+ * Pages come back zero-filled unless the caller passes PAGE_NOZERO
+ * because it is about to overwrite all of them anyway.
+ */
+#define PAGE_NOZERO	1
 
-paddr_t allocate_multiple_pages(int type, unsigned int npages);
+paddr_t allocate_one_page(int type, int flags); 
 
-paddr_t allocate_page(unsigned int free_entry_index, int type);
+/*
+ * If no free block is big enough, allocate_multiple_pages pages out
+ * user pages to clear a run (when the caller may sleep) before
+ * giving up.
+ */
+paddr_t allocate_multiple_pages(int type, unsigned int npages, int flags);
+
+unsigned int coremap_free_pages(void);
+
+paddr_t allocate_user_page(struct addrspace *as, vaddr_t vaddr, int flags);
+
+void page_incref(paddr_t paddr);
+
+void page_decref(paddr_t paddr);
+
+/*
+ * Per-CPU cache of free single pages (hung off struct cpu), so the
+ * common allocation and free paths don't take coremap_lock. Pages
+ * move between a cache and the buddy lists PAGECACHE_BATCH at a time.
+ * Cached pages are not on the buddy lists but still count as free.
+ */
+#define PAGECACHE_SIZE	16
+#define PAGECACHE_BATCH	(PAGECACHE_SIZE / 2)
+
+struct pagecache {
+	struct spinlock pc_lock;
+	unsigned int pc_count;
+	unsigned int pc_pages[PAGECACHE_SIZE];	/* coremap indices */
+	unsigned int pc_hits;
+	unsigned int pc_misses;
+	unsigned int pc_refills;
+	unsigned int pc_drains;
+	struct cpu *pc_cpu;
+	struct pagecache *pc_next;		/* all caches, for stats */
+};
+
+void pagecache_init(struct cpu *c);
+void pagecache_printstats(void);
+
+/*
+ * kmalloc tags each page it splits into blocks with the block size
+ * class plus one, so kfree can tell the class without searching.
+ * Untagged pages and addresses outside the coremap read as 0.
+ */
+void kpage_settag(vaddr_t vaddr, unsigned int tag);
+unsigned int kpage_gettag(vaddr_t vaddr);
+
+/*
+ * Per-CPU kmalloc magazines (hung off struct cpu). For each subpage
+ * size class a cpu has a loaded and a previous magazine of free
+ * blocks and trades whole magazines with a global depot, so most
+ * kmalloc and kfree calls stay off kmalloc_spinlock. See kmalloc.c.
+ */
+#define KM_NCLASSES	24
+#define KM_HISTBUCKETS	257		/* 8-byte steps to 2048, then large */
+
+struct km_magazine;
+
+/*
+ * The kmalloc sampling profiler records one allocation in every
+ * kheap_samplerate in the ring of the cpu that made it.
+ */
+#define KPROF_RING	64
+
+struct kprof_sample {
+	vaddr_t ks_site;			/* caller of kmalloc */
+	size_t ks_size;
+};
+
+struct kmcache {
+	struct spinlock kc_lock;
+	struct km_magazine *kc_loaded[KM_NCLASSES];
+	struct km_magazine *kc_previous[KM_NCLASSES];
+	unsigned int kc_hits;
+	unsigned int kc_misses;
+	unsigned int kc_trades;			/* with the depot */
+	unsigned int kc_hist[KM_HISTBUCKETS];	/* request sizes */
+	uint64_t kc_asked;			/* bytes requested */
+	uint64_t kc_given;			/* bytes after rounding */
+	unsigned int kc_countdown;		/* allocations to next sample */
+	unsigned int kc_nsamples;		/* ever put in kc_ring */
+	struct kprof_sample kc_ring[KPROF_RING];
+	struct cpu *kc_cpu;
+	struct kmcache *kc_next;		/* all caches, for reclaim */
+};
+
+void kmcache_init(struct cpu *c);
+
+/*
+ * Pool of free pages cleared ahead of time by a kernel thread, so that
+ * zero-filled allocations need not clear pages on the spot. Pool pages
+ * count as free. The thread refills the pool up to ZEROPOOL_TARGET
+ * when it drops below ZEROPOOL_LOW, but only while more than
+ * ZEROPOOL_RESERVE pages are free otherwise and no other thread wants
+ * the CPU.
+ */
+#define ZEROPOOL_TARGET		32
+#define ZEROPOOL_LOW		(ZEROPOOL_TARGET / 2)
+#define ZEROPOOL_RESERVE	64
+
+#define FILECACHE_BUCKETS	128
+
+/*
+ * Swap space on a raw disk, attached at boot with vfs_swapon(). The
+ * slot functions and swap_read/swap_write require swap_acquire().
+ */
+#define SWAP_DEVICE	"lhd0"
 
-void free_page(unsigned int used_entry_index);
+void swap_bootstrap(void);
+bool swap_enabled(void);
+void swap_acquire(void);
+void swap_release(void);
+bool swap_holding(void);
+int swap_alloc(unsigned int *slot);
+void swap_free(unsigned int slot);
+int swap_read(unsigned int slot, paddr_t paddr);
+int swap_write(unsigned int slot, paddr_t paddr);
 
 
 #endif /* _VM_H_ */
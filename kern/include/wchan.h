@@ -36,8 +36,15 @@
 
 
 struct spinlock; /* in spinlock.h */
+struct thread; /* in thread.h */
 struct wchan; /* Opaque */
 
+/*
+ * Set up the allocator for wait channels. Called once during system
+ * startup, before anything creates one.
+ */
+void wchan_bootstrap(void);
+
 /*
  * Create a wait channel. Use NAME as a symbolic name for the channel.
  * NAME should be a string constant; if not, the caller is responsible
@@ -76,5 +83,12 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Wake up thread T, which the caller knows to be sleeping on the
+ * channel. The associated spinlock should be locked.
+ */
+void wchan_wakethread(struct wchan *wc, struct spinlock *lk,
+		      struct thread *t);
+
 
 #endif /* _WCHAN_H_ */
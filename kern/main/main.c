@@ -42,11 +42,13 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <wchan.h>
 #include <vm.h>
 #include <mainbus.h>
 #include <vfs.h>
 #include <device.h>
 #include <syscall.h>
+#include <filehandle.h>
 #include <test.h>
 #include <kern/test161.h>
 #include <version.h>
@@ -110,10 +112,12 @@ boot(void)
 	/* Early initialization. */
 	ram_bootstrap();
 	cm_bootstrap();
+	wchan_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+	fh_bootstrap();
 	kheap_nextgeneration();
 
 	/* Probe and initialize devices. Interrupts should come on. */
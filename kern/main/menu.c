@@ -40,6 +40,10 @@
 #include <thread.h>
 #include <proc.h>
 #include <vfs.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <mips/tlb.h>
+#include <objcache.h>
 #include <sfs.h>
 #include <syscall.h>
 #include <test.h>
@@ -479,6 +483,47 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapfrag(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_printfrag();
+
+	return 0;
+}
+
+/*
+ * Command for the kmalloc allocation-site profiler. With an argument,
+ * sets the sampling rate (0 is off) and starts over.
+ */
+static
+int
+cmd_kheapprofile(int nargs, char **args)
+{
+	int rate;
+
+	if (nargs > 2) {
+		kprintf("Usage: kprof [rate]\n");
+		return 0;
+	}
+	if (nargs == 2) {
+		rate = atoi(args[1]);
+		if (rate < 0) {
+			kprintf("kprof: rate cannot be negative\n");
+			return 0;
+		}
+		kheap_setsamplerate(rate);
+		return 0;
+	}
+
+	kheap_printprofile();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapused(int nargs, char **args)
@@ -520,6 +565,225 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_pagecachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	pagecache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_tlbstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	tlbstate_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_faultaround(int nargs, char **args)
+{
+	int around, ahead;
+
+	if (nargs != 1 && nargs != 3) {
+		kprintf("Usage: fa [pages-around pages-ahead]\n");
+		return 0;
+	}
+	if (nargs == 3) {
+		around = atoi(args[1]);
+		ahead = atoi(args[2]);
+		if (around < 0 || ahead < 0) {
+			kprintf("fa: page counts cannot be negative\n");
+			return 0;
+		}
+		/* more neighbours than TLB slots would only evict each other */
+		vm_faultaround = around > NUM_TLB ? NUM_TLB : around;
+		vm_prefault = ahead > PREFAULT_MAX ? PREFAULT_MAX : ahead;
+		vm_faultstats_reset();
+	}
+
+	vm_faultstats();
+
+	return 0;
+}
+
+/*
+ * Command for printing memory pressure and per-process memory use.
+ */
+static
+int
+cmd_mem(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	vm_printmem();
+
+	return 0;
+}
+
+/*
+ * Command for dumping coremap ownership.
+ */
+static
+int
+cmd_coremapdump(int nargs, char **args)
+{
+	unsigned first = 0, count = (unsigned)-1;
+
+	if (nargs > 3) {
+		kprintf("Usage: cmd [first-page [count]]\n");
+		return 0;
+	}
+	if (nargs > 1) {
+		first = atoi(args[1]);
+	}
+	if (nargs > 2) {
+		count = atoi(args[2]);
+	}
+
+	vm_dumpcoremap(first, count);
+
+	return 0;
+}
+
+/*
+ * Command for printing object cache stats.
+ */
+static
+int
+cmd_objcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	objcache_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for the scheduler: shows each thread's level and cpu time,
+ * or with arguments sets the quantum of a level.
+ */
+static
+int
+cmd_sched(int nargs, char **args)
+{
+	int level, quantum;
+
+	if (nargs != 1 && nargs != 3) {
+		kprintf("Usage: sched [level quantum]\n");
+		return 0;
+	}
+	if (nargs == 3) {
+		level = atoi(args[1]);
+		quantum = atoi(args[2]);
+		if (level < 0 || level >= SCHED_NLEVELS || quantum < 1) {
+			kprintf("sched: level is 0-%d, quantum at least 1\n",
+				SCHED_NLEVELS - 1);
+			return 0;
+		}
+		sched_quantum[level] = quantum;
+	}
+
+	thread_printsched();
+
+	return 0;
+}
+
+/*
+ * Command for showing per-cpu timer and tick stats.
+ */
+static
+int
+cmd_clockstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	clock_printstats();
+
+	return 0;
+}
+
+/*
+ * Command for compacting physical memory and showing fragmentation.
+ */
+static
+int
+cmd_compact(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: compact [order]\n");
+		return 0;
+	}
+	if (nargs == 2) {
+		int order = atoi(args[1]);
+		kprintf("compact: order %d %s\n", order,
+			vm_compact(order) ? "opened" : "failed");
+	}
+
+	vm_fragstats();
+
+	return 0;
+}
+
+/*
+ * Command for setting the heap limit given to new processes.
+ */
+static
+int
+cmd_heaplimit(int nargs, char **args)
+{
+	if (nargs == 2) {
+		vm_heaplimit = atoi(args[1]);
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: hl [pages]\n");
+		return 0;
+	}
+
+	kprintf("heap limit for new processes: %u pages\n", vm_heaplimit);
+
+	return 0;
+}
+
+/*
+ * Command for turning superpages on and off.
+ */
+static
+int
+cmd_superpages(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "on")) {
+		vm_superpages = true;
+		vm_faultstats_reset();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		vm_superpages = false;
+		vm_faultstats_reset();
+	}
+	else if (nargs != 1) {
+		kprintf("Usage: sp [on|off]\n");
+		return 0;
+	}
+
+	vm_faultstats();
+
+	return 0;
+}
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -587,6 +851,8 @@ static const char *testmenu[] = {
 	"[km3] Large kmalloc test            ",
 	"[km4] Multipage kmalloc test        ",
 	"[km5] kmalloc coremap alloc test    ",
+	"[cmb] Coremap allocator benchmark   ",
+	"[tmt] Timer test                    ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -669,8 +935,21 @@ static const char *mainmenu[] = {
 	"[?t] Tests menu                     ",
 	"[kh] Kernel heap stats              ",
 	"[khu] Kernel heap usage             ",
+	"[khf] Kernel heap fragmentation     ",
+	"[kprof] Kernel heap profile [rate]  ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[pcs] Per-CPU page cache stats      ",
+	"[tlbs] Per-CPU TLB stats            ",
+	"[fa] Fault-around settings and stats",
+	"[sp] Superpages on/off and stats    ",
+	"[hl] Heap limit for new processes   ",
+	"[mem] Memory use by process         ",
+	"[cmd] Coremap dump                  ",
+	"[compact] Compact memory, show frag ",
+	"[oc] Object cache stats             ",
+	"[sched] Scheduler stats and quanta  ",
+	"[clk] Timer and tick stats          ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -724,8 +1003,21 @@ static struct {
 	/* stats */
 	{ "kh",         cmd_kheapstats },
 	{ "khu",        cmd_kheapused },
+	{ "khf",        cmd_kheapfrag },
+	{ "kprof",      cmd_kheapprofile },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "pcs",        cmd_pagecachestats },
+	{ "tlbs",       cmd_tlbstats },
+	{ "fa",         cmd_faultaround },
+	{ "sp",         cmd_superpages },
+	{ "hl",         cmd_heaplimit },
+	{ "mem",        cmd_mem },
+	{ "cmd",        cmd_coremapdump },
+	{ "compact",    cmd_compact },
+	{ "oc",         cmd_objcachestats },
+	{ "sched",      cmd_sched },
+	{ "clk",        cmd_clockstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -737,6 +1029,8 @@ static struct {
 	{ "km3",	kmalloctest3 },
 	{ "km4",	kmalloctest4 },
 	{ "km5",	kmalloctest5 },
+	{ "cmb",	coremapbench },
+	{ "tmt",	timertest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -65,12 +65,40 @@
 #include <test.h>
 #include <limits.h>
 #include <filehandle.h>
+#include <synch.h>
+#include <objcache.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
  */
 struct proc *kproc;
 
+/*
+ * Procs come from an object cache that keeps p_lock set up between
+ * uses. p_exitSem is made fresh for each proc, since a proc can go
+ * back to the cache with an exit nobody waited for still posted.
+ */
+static struct objcache *proc_cache;
+
+static
+int
+proc_ctor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_init(&proc->p_lock);
+	return 0;
+}
+
+static
+void
+proc_dtor(void *obj)
+{
+	struct proc *proc = obj;
+
+	spinlock_cleanup(&proc->p_lock);
+}
+
 /*
  * Create a proc structure.
  */
@@ -80,19 +108,24 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = objcache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_parentpid = -1;
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		objcache_free(proc_cache, proc);
+		return NULL;
+	}
+	proc->p_exitSem = sem_create("exitSem", 0);
+	if (proc->p_exitSem == NULL) {
+		kfree(proc->p_name);
+		objcache_free(proc_cache, proc);
 		return NULL;
 	}
 
 	proc->p_numthreads = 0;
-	spinlock_init(&proc->p_lock);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -104,11 +137,9 @@ proc_create(const char *name)
 		proc->p_fileTable[i] = NULL;
 	}
 	
-	if(proc->p_exitSem==NULL){
-		proc->p_exitSem = sem_create("exitSem", 0);
-	}
 	proc->p_pid = 0;
 	proc->p_state = 1;
+	proc->p_killed = false;
 
 	return proc;
 }
@@ -119,18 +150,23 @@ proc_createchild(const char *name){
 	//struct proc * p = proc_create(name);
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = objcache_alloc(proc_cache);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		objcache_free(proc_cache, proc);
+		return NULL;
+	}
+	proc->p_exitSem = sem_create("exitSem", 0);
+	if (proc->p_exitSem == NULL) {
+		kfree(proc->p_name);
+		objcache_free(proc_cache, proc);
 		return NULL;
 	}
 
 	proc->p_numthreads = 0;
-	spinlock_init(&proc->p_lock);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -142,11 +178,9 @@ proc_createchild(const char *name){
 		proc->p_fileTable[i] = NULL;
 	}
 
-	if(proc->p_exitSem==NULL){
-		proc->p_exitSem = sem_create("exitSem", 0);
-	}
 	proc->p_pid = -1;
 	proc->p_state = 1;
+	proc->p_killed = false;
 	return proc;
 }
 /*
@@ -190,7 +224,6 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_numthreads == 0);
-	spinlock_cleanup(&proc->p_lock);
 	
 	for (int i = 0; i < 64; i++) {
 		struct filehandle *fh=proc->p_fileTable[i] ;
@@ -205,10 +238,9 @@ proc_destroy(struct proc *proc)
 		}
 	}
 	
-	if(proc->p_exitSem != NULL)
-		sem_destroy(proc->p_exitSem);
+	sem_destroy(proc->p_exitSem);
 	kfree(proc->p_name);
-	kfree(proc);
+	objcache_free(proc_cache, proc);
 	
 }
 
@@ -218,6 +250,11 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_cache = objcache_create("proc", sizeof(struct proc),
+				     proc_ctor, proc_dtor);
+	if (proc_cache == NULL) {
+		panic("proc_bootstrap: out of memory\n");
+	}
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -1,5 +1,7 @@
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
+#include <objcache.h>
 #include <filehandle.h>
 #include <synch.h>
 #include <vnode.h>
@@ -11,24 +13,50 @@
 
 
 
+/*
+ * File handles come from an object cache that keeps each one's lock
+ * created, so opening a file costs no lock_create.
+ */
+static struct objcache *fh_cache;
+
+static int fh_ctor(void *obj){
+	struct filehandle *fh = obj;
+
+	fh->fh_lock = lock_create("fh");
+	return fh->fh_lock == NULL ? ENOMEM : 0;
+}
+
+static void fh_dtor(void *obj){
+	struct filehandle *fh = obj;
+
+	lock_destroy(fh->fh_lock);
+}
+
+void fh_bootstrap(void){
+	fh_cache = objcache_create("filehandle", sizeof(struct filehandle),
+				   fh_ctor, fh_dtor);
+	if (fh_cache == NULL) {
+		panic("fh_bootstrap: out of memory\n");
+	}
+}
+
 struct filehandle * fh_create(const char *name, struct vnode *vnode){
 	
 	struct filehandle *fh;
 
-	fh = kmalloc(sizeof(*fh));
+	fh = objcache_alloc(fh_cache);
 	if (fh == NULL) {
 		return NULL;
 	}
 
 	fh->fh_name = kstrdup(name);
 	if (fh->fh_name == NULL) {
-		kfree(fh);
+		objcache_free(fh_cache, fh);
 		return NULL;
 	}
 	fh->fh_offset = 0;
 	fh->fh_refcount = 0;
 	fh->fh_vnode = vnode;
-	fh->fh_lock = lock_create("fh");
 
 	return fh;
 }
@@ -36,9 +64,8 @@ struct filehandle * fh_create(const char *name, struct vnode *vnode){
 // deallocate memory
 void fh_destroy(struct filehandle *fh){
 		KASSERT(fh != NULL);
-		lock_destroy(fh->fh_lock);
 		kfree(fh->fh_name);
-		kfree(fh);
+		objcache_free(fh_cache, fh);
 }
 
 int fh_assign(struct filehandle* fh)
@@ -42,8 +42,12 @@
  * circumstances, as_prepare_load and as_complete_load probably don't
  * need to do anything.
  *
- * If you wanted to support memory-mapped executables you would need
- * to rearrange this to map each segment.
+ * Read-only segments that are laid out in the file page for page, as
+ * the linker normally arranges for text, are not loaded at all: they
+ * are defined with as_define_text and paged in from the file on
+ * demand, sharing frames with any other process running the same
+ * executable. Note that such pages do not see later write()s to the
+ * executable by a running program's neighbours; don't do that.
  *
  * To support dynamically linked executables with shared libraries
  * you'd need to change this to load the "ELF interpreter" (dynamic
@@ -145,6 +149,23 @@ load_segment(struct addrspace *as, struct vnode *v,
 	return result;
 }
 
+/*
+ * Can segment PH be paged in straight from the file? It has to be
+ * read-only, have no zero-filled tail, sit at the same offset within
+ * a page in the file as in memory, and lie entirely in user space
+ * (nothing goes through uiomove to check that for us).
+ */
+static
+bool
+elf_shareable(const Elf_Phdr *ph)
+{
+	return !(ph->p_flags & PF_W) &&
+		ph->p_memsz > 0 && ph->p_filesz == ph->p_memsz &&
+		(ph->p_offset & ~PAGE_FRAME) == (ph->p_vaddr & ~PAGE_FRAME) &&
+		ph->p_vaddr + ph->p_memsz > ph->p_vaddr &&
+		ph->p_vaddr + ph->p_memsz <= USERSPACETOP;
+}
+
 /*
  * Load an ELF executable user program into the current address space.
  *
@@ -243,11 +264,20 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
-		result = as_define_region(as,
-					  ph.p_vaddr, ph.p_memsz,
-					  ph.p_flags & PF_R,
-					  ph.p_flags & PF_W,
-					  ph.p_flags & PF_X);
+		if (elf_shareable(&ph)) {
+			result = as_define_text(as,
+						ph.p_vaddr, ph.p_memsz,
+						ph.p_flags & PF_R,
+						ph.p_flags & PF_X,
+						v, ph.p_offset);
+		}
+		else {
+			result = as_define_region(as,
+						  ph.p_vaddr, ph.p_memsz,
+						  ph.p_flags & PF_R,
+						  ph.p_flags & PF_W,
+						  ph.p_flags & PF_X);
+		}
 		if (result) {
 			return result;
 		}
@@ -288,6 +318,11 @@ load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+		if (elf_shareable(&ph)) {
+			/* paged in on demand */
+			continue;
+		}
+
 		result = load_segment(as, v, ph.p_offset, ph.p_vaddr,
 				      ph.p_memsz, ph.p_filesz,
 				      ph.p_flags & PF_X);
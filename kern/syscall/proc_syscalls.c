@@ -26,6 +26,8 @@
 #include <mainbus.h>
 #include <mips/tlb.h>
 #include <spl.h>
+#include <filehandle.h>
+#include <kern/mman.h>
 
 struct proc* process_table[128];
 pid_t current_pid = 0;
@@ -172,10 +174,13 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retVal)
 	
 	//if(p->p_exitSem != NULL)
 	//sem_destroy(p->p_exitSem);
+	/* normally already gone; see proc_exit */
 	struct addrspace *as;
 	as = p->p_addrspace;
 	p->p_addrspace = NULL;
-	as_destroy(as);
+	if (as != NULL) {
+		as_destroy(as);
+	}
 	
 	for (int i = 0; i < 64; i++) {
 		struct filehandle *fh=p->p_fileTable[i] ;
@@ -205,11 +210,100 @@ int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *retVal)
 	return 0;
 }
 void sys__exit(int exitcode) {
+	proc_exit(_MKWAIT_EXIT(exitcode));
+}
+
+/*
+ * End the current process with wait status status. The address space
+ * goes now rather than when the parent waits, so that a process that
+ * is killed for memory gives it back at once. It is detached under
+ * ptLock so that proc_oomselect and proc_printmem never look at one
+ * that is being destroyed.
+ */
+void
+proc_exit(int status)
+{
 	struct proc *p = curproc;
-    p->p_exitCode = _MKWAIT_EXIT(exitcode); 
-    V(p->p_exitSem);
+
+	lock_acquire(ptLock);
+	struct addrspace *as = proc_setas(NULL);
+	lock_release(ptLock);
+	if (as != NULL) {
+		as_deactivate();
+		as_destroy(as);
+	}
+
+	p->p_exitCode = status;
+	V(p->p_exitSem);
 	thread_exit();
-	
+}
+
+static
+unsigned
+proc_mempages(struct addrspace *as)
+{
+	return as->rss + as->swapped + as->pt_pages;
+}
+
+/*
+ * Pick the process to kill for memory: the one with the most pages
+ * resident, in swap or in page tables. Returns NULL, with *pending
+ * set, if an earlier victim has not gone yet; NULL with *pending clear
+ * if there is no candidate. The victim is marked killed.
+ */
+struct proc *
+proc_oomselect(bool *pending)
+{
+	struct proc *victim = NULL;
+	unsigned most = 0;
+
+	*pending = false;
+	lock_acquire(ptLock);
+	for (int i = 1; i < 128; i++) {
+		struct proc *p = process_table[i];
+		if (p == NULL || p->p_addrspace == NULL) {
+			continue;
+		}
+		if (p->p_killed) {
+			*pending = true;
+			break;
+		}
+		if (proc_mempages(p->p_addrspace) > most) {
+			most = proc_mempages(p->p_addrspace);
+			victim = p;
+		}
+	}
+	if (*pending) {
+		victim = NULL;
+	}
+	else if (victim != NULL) {
+		victim->p_killed = true;
+	}
+	lock_release(ptLock);
+	return victim;
+}
+
+/*
+ * Print the memory use of every live process, in pages.
+ */
+void
+proc_printmem(void)
+{
+	kprintf("  pid name                 as              rss  swap    pt  heap\n");
+	lock_acquire(ptLock);
+	for (int i = 1; i < 128; i++) {
+		struct proc *p = process_table[i];
+		if (p == NULL || p->p_addrspace == NULL) {
+			continue;
+		}
+		struct addrspace *as = p->p_addrspace;
+		kprintf("%5d %-20s %p %5u %5u %5u %5u%s\n", p->p_pid,
+			p->p_name, as, as->rss, as->swapped, as->pt_pages,
+			as->heap == NULL ? 0 :
+			(as->heap->reg_end - as->heap->reg_start) / PAGE_SIZE,
+			p->p_killed ? " (killed)" : "");
+	}
+	lock_release(ptLock);
 }
 int sys_execv(const char *progname, char **args)
 {
@@ -314,7 +408,9 @@ int sys_execv(const char *progname, char **args)
 		kfree(args);
 		return ENOMEM;
 	}
+	lock_acquire(ptLock);
 	struct addrspace *prev_as = proc_setas(as);
+	lock_release(ptLock);
 	as_activate();
 
 	result = load_elf(v, &entrypoint);
@@ -411,33 +507,71 @@ sys_sbrk(intptr_t amount, vaddr_t *retval){
 
 	if (new < as->heap->reg_start || (amount <= (-4096 * 1024 * 256)))  
 		return (void *)EINVAL;
-	if (new >= (USERSTACK - 3000 * PAGE_SIZE) || new > USERSPACETOP) 
+	if (new > USERSPACETOP) 
+		return (void *)ENOMEM;
+	if (new > as->heap->reg_end &&
+	    (new - as->heap->reg_start) / PAGE_SIZE > as->heap_max)
+		return (void *)ENOMEM;
+	if (new > as->heap->reg_end && !as_range_free(as, as->heap->reg_end, new))
 		return (void *)ENOMEM;
 
 	if (new < as->heap->reg_end) {
-		int size = ((as->heap->reg_end - new) & PAGE_FRAME) / PAGE_SIZE;
-		for (int j = 0; j < size; ++j) {
-			vaddr_t free = new + j * PAGE_SIZE;
-			struct page_table_entry *pte = find_pte(as->first, free);
-			if (pte != NULL) {
-				if (pte->is_valid) {
-					vaddr_t pvaddr = PADDR_TO_KVADDR(pte->base);
-					free_kpages(pvaddr);
-					pte->is_valid = 0;
-					pte->base = 0;
-					int spl = splhigh();
-					int i = tlb_probe(free, 0);
-					if (i >= 0) {
-						tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-					}
-					splx(spl);
-				}
-			}
-		}
+		unsigned int size = (as->heap->reg_end - new) / PAGE_SIZE;
+		/* one shootdown for the lot, then free the frames in batches */
+		vm_tlbshootdown_range(as, new, size);
+		pte_release_range(as, new, size);
 	}
 	as->heap->reg_end = new;
 	return (void *)0;
 }
+
+int
+sys_mmap(vaddr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+	struct addrspace *as = proc_getas();
+	struct vnode *vn = NULL;
+	int type = flags & MAP_TYPE;
+
+	if (prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC))
+		return EINVAL;
+	if ((type != MAP_SHARED && type != MAP_PRIVATE) || len == 0)
+		return EINVAL;
+
+	if (!(flags & MAP_ANONYMOUS)) {
+		if (fd >= OPEN_MAX || fd < 0 || curproc->p_fileTable[fd] == NULL)
+			return EBADF;
+		struct filehandle *fh = curproc->p_fileTable[fd];
+		int mode = fh->fh_flags & O_ACCMODE;
+		if (mode == O_WRONLY)
+			return EACCES;
+		if (type == MAP_SHARED && (prot & PROT_WRITE) && mode != O_RDWR)
+			return EACCES;
+		if (offset < 0 || (offset & ~(off_t) PAGE_FRAME))
+			return EINVAL;
+		vn = fh->fh_vnode;
+		int result = VOP_MMAP(vn);
+		if (result)
+			return result;
+	}
+
+	int perms = ((prot & PROT_READ) ? REG_READ : 0) |
+		((prot & PROT_WRITE) ? REG_WRITE : 0) |
+		((prot & PROT_EXEC) ? REG_EXEC : 0);
+	int result = as_define_mmap(as, &addr, len, perms,
+				    (flags & MAP_FIXED) != 0, vn, offset,
+				    type == MAP_SHARED && vn != NULL);
+	if (result)
+		return result;
+	*retval = addr;
+	return 0;
+}
+
+int
+sys_munmap(vaddr_t addr, size_t len)
+{
+	return as_unmap(proc_getas(), addr, len);
+}
 /*
 void *
 sys_sbrk(intptr_t amount, vaddr_t *retval){
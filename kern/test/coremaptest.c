@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Coremap allocator microbenchmark.
+ *
+ * Fills physical memory to a series of levels with single kernel
+ * pages and, at each level, times a burst of allocate/free pairs for
+ * a few allocation sizes. Reports allocations per second so changes
+ * to the page allocator can be compared.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <vm.h>
+#include <test.h>
+#include <kern/test161.h>
+
+#define CMB_ITERATIONS 2000
+
+static const unsigned cmb_levels[] = { 0, 25, 50, 75, 90 };
+static const unsigned cmb_sizes[] = { 1, 2, 4, 8 };
+
+#define CMB_NLEVELS (sizeof(cmb_levels) / sizeof(cmb_levels[0]))
+#define CMB_NSIZES (sizeof(cmb_sizes) / sizeof(cmb_sizes[0]))
+
+/*
+ * Time CMB_ITERATIONS allocate/free pairs of npages pages. Returns
+ * allocations per second, or 0 if an allocation failed.
+ */
+static
+unsigned
+cmb_rate(unsigned npages)
+{
+	struct timespec start, end, diff;
+	uint64_t usecs;
+	vaddr_t va;
+	unsigned i;
+
+	gettime(&start);
+	for (i = 0; i < CMB_ITERATIONS; i++) {
+		va = alloc_kpages(npages);
+		if (va == 0) {
+			return 0;
+		}
+		free_kpages(va);
+	}
+	gettime(&end);
+
+	timespec_sub(&end, &start, &diff);
+	usecs = (uint64_t)diff.tv_sec * 1000000 + diff.tv_nsec / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	return (unsigned)((uint64_t)CMB_ITERATIONS * 1000000 / usecs);
+}
+
+int
+coremapbench(int nargs, char **args)
+{
+	unsigned avail, held, target, level, size;
+	vaddr_t chain, va;
+
+	(void)nargs;
+	(void)args;
+
+	avail = coremap_free_pages();
+	kprintf("Starting coremap benchmark: %u free pages\n", avail);
+
+	/*
+	 * Pages we hold to reach a fill level are chained through
+	 * their first word, so the benchmark needs no other memory.
+	 */
+	chain = 0;
+	held = 0;
+	for (level = 0; level < CMB_NLEVELS; level++) {
+		target = avail / 100 * cmb_levels[level];
+		while (held < target) {
+			va = alloc_kpages(1);
+			if (va == 0) {
+				break;
+			}
+			*(vaddr_t *)va = chain;
+			chain = va;
+			held++;
+		}
+
+		kprintf("%3u%% full:", held * 100 / avail);
+		for (size = 0; size < CMB_NSIZES; size++) {
+			kprintf("  %up %u/s", cmb_sizes[size],
+				cmb_rate(cmb_sizes[size]));
+		}
+		kprintf("\n");
+	}
+
+	while (chain != 0) {
+		va = chain;
+		chain = *(vaddr_t *)va;
+		free_kpages(va);
+	}
+
+	success(TEST161_SUCCESS, SECRET, "cmb");
+	return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Timer test.
+ *
+ * Several threads sleep with thread_sleep_until for random times
+ * under a twentieth of a second, checking that none wakes early and
+ * reporting how late they wake. Then a timer is cancelled before it
+ * fires, and another after, to check timer_cancel.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <test.h>
+#include <kern/test161.h>
+
+#define TMT_THREADS	8
+#define TMT_SLEEPS	10
+#define TMT_MAXSLEEP	(NS_PER_SEC / 20)
+
+static struct semaphore *tmt_done;
+static struct spinlock tmt_lock = SPINLOCK_INITIALIZER;
+static unsigned tmt_early;
+static uint64_t tmt_latesum;
+static uint64_t tmt_latemax;
+
+static
+void
+tmt_sleeper(void *junk, unsigned long num)
+{
+	uint64_t deadline, now;
+	unsigned i;
+
+	(void)junk;
+	(void)num;
+
+	for (i = 0; i < TMT_SLEEPS; i++) {
+		deadline = clock_ns() + 1 + random() % TMT_MAXSLEEP;
+		if (thread_sleep_until(deadline)) {
+			panic("tmt: thread_sleep_until: out of memory\n");
+		}
+		now = clock_ns();
+
+		spinlock_acquire(&tmt_lock);
+		if (now < deadline) {
+			tmt_early++;
+		}
+		else {
+			tmt_latesum += now - deadline;
+			if (now - deadline > tmt_latemax) {
+				tmt_latemax = now - deadline;
+			}
+		}
+		spinlock_release(&tmt_lock);
+	}
+	V(tmt_done);
+}
+
+static
+void
+tmt_fire(void *data)
+{
+	*(volatile bool *)data = true;
+}
+
+int
+timertest(int nargs, char **args)
+{
+	volatile bool fired;
+	struct timer tm;
+	bool ok = true;
+	unsigned i;
+	int result;
+
+	(void)nargs;
+	(void)args;
+
+	tmt_done = sem_create("tmt", 0);
+	if (tmt_done == NULL) {
+		panic("tmt: sem_create failed\n");
+	}
+	tmt_early = 0;
+	tmt_latesum = tmt_latemax = 0;
+
+	kprintf("Starting timer test...\n");
+	for (i = 0; i < TMT_THREADS; i++) {
+		result = thread_fork("tmt", NULL, tmt_sleeper, NULL, i);
+		if (result) {
+			panic("tmt: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i = 0; i < TMT_THREADS; i++) {
+		P(tmt_done);
+	}
+	sem_destroy(tmt_done);
+
+	kprintf("%u sleeps: %u early, %lu us late on average, %lu us at most\n",
+		TMT_THREADS * TMT_SLEEPS, tmt_early,
+		(unsigned long)(tmt_latesum / (TMT_THREADS * TMT_SLEEPS) / 1000),
+		(unsigned long)(tmt_latemax / 1000));
+	if (tmt_early > 0) {
+		ok = false;
+	}
+
+	fired = false;
+	timer_init(&tm, tmt_fire, (void *)&fired);
+	if (timer_add(&tm, clock_ns() + NS_PER_SEC)) {
+		panic("tmt: timer_add: out of memory\n");
+	}
+	if (!timer_cancel(&tm) || fired) {
+		kprintf("tmt: cancelling a pending timer failed\n");
+		ok = false;
+	}
+
+	if (timer_add(&tm, clock_ns() + NS_PER_HARDCLOCK)) {
+		panic("tmt: timer_add: out of memory\n");
+	}
+	thread_sleep_until(clock_ns() + 2 * NS_PER_HARDCLOCK);
+	if (timer_cancel(&tm) || !fired) {
+		kprintf("tmt: timer did not fire\n");
+		ok = false;
+	}
+
+	success(ok ? TEST161_SUCCESS : TEST161_FAIL, SECRET, "tmt");
+	return 0;
+}
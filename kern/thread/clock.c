@@ -28,19 +28,25 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <cpu.h>
+#include <spl.h>
 #include <wchan.h>
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <mainbus.h>
 
 /*
  * Time handling.
  *
- * This is pretty primitive. A real kernel will typically have some
- * kind of support for scheduling callbacks to happen at specific
- * points in the future, usually with more resolution than one second.
+ * Besides hardclock and the once-a-second timerclock, each cpu has a
+ * heap of timers (struct timer) that call a function at a given
+ * clock_ns() time, at whatever resolution the cpu's timer interrupt
+ * can manage. The timer interrupt is set afresh each time for the
+ * next tick or timer, whichever is first, which lets an idle cpu
+ * skip its ticks.
  *
  * A real kernel also has to maintain the time of day; in OS/161 we
  * skimp on that because we have a known-good hardware clock.
@@ -50,8 +56,16 @@
  * Timing constants. These should be tuned along with any work done on
  * the scheduler.
  */
-#define SCHEDULE_HARDCLOCKS	4	/* Reschedule every 4 hardclocks. */
-#define MIGRATE_HARDCLOCKS	16	/* Migrate every 16 hardclocks. */
+#define SCHEDULE_HARDCLOCKS	4	/* Age run queues every 4 hardclocks. */
+
+#define TIMER_HEAPMIN		16	/* first size of a cpu's timer heap */
+#define CLOCK_IDLE_MAX		NS_PER_SEC	/* longest idle without waking */
+
+/* Set by clock_start once clock_ns() works. */
+static bool clock_started;
+
+/* All cpus, for clock_printstats. */
+static struct cpu *clockcpus;
 
 /*
  * Once a second, everything waiting on lbolt is awakened by CPU 0.
@@ -59,6 +73,13 @@
 static struct wchan *lbolt;
 static struct spinlock lbolt_lock;
 
+/*
+ * Threads in thread_sleep_until wait here, each to be woken by its
+ * own timer.
+ */
+static struct wchan *sleep_wchan;
+static struct spinlock sleep_lock;
+
 /*
  * Setup.
  */
@@ -70,6 +91,353 @@ hardclock_bootstrap(void)
 	if (lbolt == NULL) {
 		panic("Couldn't create lbolt\n");
 	}
+	spinlock_init(&sleep_lock);
+	sleep_wchan = wchan_create("timersleep");
+	if (sleep_wchan == NULL) {
+		panic("Couldn't create timersleep\n");
+	}
+}
+
+void
+clock_cpu_init(struct cpu *c)
+{
+	spinlock_init(&c->c_timer_lock);
+	c->c_timers = NULL;
+	c->c_ntimers = c->c_maxtimers = 0;
+	c->c_timersfired = 0;
+	c->c_nexttick = 0;
+	c->c_tickless = false;
+	c->c_idlestart = 0;
+	c->c_idleperiods = c->c_ticksskipped = 0;
+
+	/* cpus are created one at a time, before they start */
+	c->c_clocknext = clockcpus;
+	clockcpus = c;
+}
+
+uint64_t
+clock_ns(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Timer heaps. Each is a binary heap by deadline in c->c_timers[],
+// and each timer knows its index so it can be taken out from the
+// middle when cancelled.
+//
+
+static
+void
+heap_set(struct cpu *c, unsigned i, struct timer *tm)
+{
+	c->c_timers[i] = tm;
+	tm->tm_index = i;
+}
+
+static
+void
+heap_up(struct cpu *c, unsigned i)
+{
+	struct timer *tm = c->c_timers[i];
+	unsigned parent;
+
+	while (i > 0) {
+		parent = (i - 1) / 2;
+		if (c->c_timers[parent]->tm_deadline <= tm->tm_deadline) {
+			break;
+		}
+		heap_set(c, i, c->c_timers[parent]);
+		i = parent;
+	}
+	heap_set(c, i, tm);
+}
+
+static
+void
+heap_down(struct cpu *c, unsigned i)
+{
+	struct timer *tm = c->c_timers[i];
+	unsigned child;
+
+	while ((child = 2 * i + 1) < c->c_ntimers) {
+		if (child + 1 < c->c_ntimers &&
+		    c->c_timers[child + 1]->tm_deadline <
+		    c->c_timers[child]->tm_deadline) {
+			child++;
+		}
+		if (tm->tm_deadline <= c->c_timers[child]->tm_deadline) {
+			break;
+		}
+		heap_set(c, i, c->c_timers[child]);
+		i = child;
+	}
+	heap_set(c, i, tm);
+}
+
+static
+void
+heap_remove(struct cpu *c, unsigned i)
+{
+	struct timer *tm = c->c_timers[i];
+
+	KASSERT(spinlock_do_i_hold(&c->c_timer_lock));
+	KASSERT(i < c->c_ntimers);
+
+	c->c_ntimers--;
+	if (i < c->c_ntimers) {
+		heap_set(c, i, c->c_timers[c->c_ntimers]);
+		if (c->c_timers[i]->tm_deadline < tm->tm_deadline) {
+			heap_up(c, i);
+		}
+		else {
+			heap_down(c, i);
+		}
+	}
+	tm->tm_index = TIMER_IDLE;
+}
+
+/*
+ * Set the current cpu's timer interrupt for its next tick or its
+ * first timer, whichever is sooner. An idle cpu has no next tick.
+ */
+static
+void
+clock_program(uint64_t now)
+{
+	struct cpu *c = curcpu->c_self;
+	uint64_t next;
+
+	next = c->c_tickless ? now + CLOCK_IDLE_MAX : c->c_nexttick;
+	spinlock_acquire(&c->c_timer_lock);
+	if (c->c_ntimers > 0 && c->c_timers[0]->tm_deadline < next) {
+		next = c->c_timers[0]->tm_deadline;
+	}
+	spinlock_release(&c->c_timer_lock);
+
+	if (next <= now) {
+		mainbus_timer_set(0);
+	}
+	else if (next - now > CLOCK_IDLE_MAX) {
+		mainbus_timer_set(CLOCK_IDLE_MAX);
+	}
+	else {
+		mainbus_timer_set(next - now);
+	}
+}
+
+void
+timer_init(struct timer *tm, void (*func)(void *), void *data)
+{
+	tm->tm_deadline = 0;
+	tm->tm_func = func;
+	tm->tm_data = data;
+	tm->tm_cpu = NULL;
+	tm->tm_index = TIMER_IDLE;
+}
+
+/*
+ * Put a timer on the current cpu's heap. If the heap is full, grow
+ * it, which means letting go of the lock (and perhaps the cpu) to
+ * call kmalloc, and trying again.
+ */
+int
+timer_add(struct timer *tm, uint64_t deadline)
+{
+	struct cpu *c;
+	struct timer **heap, **old;
+	unsigned max;
+	bool first;
+	int spl;
+
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(tm->tm_index == TIMER_IDLE);
+	tm->tm_deadline = deadline;
+
+	while (1) {
+		/* Stay on this cpu until the timer is on its heap. */
+		spl = splhigh();
+		c = curcpu->c_self;
+		spinlock_acquire(&c->c_timer_lock);
+		if (c->c_ntimers < c->c_maxtimers) {
+			break;
+		}
+		max = c->c_maxtimers;
+		spinlock_release(&c->c_timer_lock);
+		splx(spl);
+
+		max = max == 0 ? TIMER_HEAPMIN : max * 2;
+		heap = kmalloc(max * sizeof(*heap));
+		if (heap == NULL) {
+			return ENOMEM;
+		}
+		old = heap;
+		spinlock_acquire(&c->c_timer_lock);
+		if (c->c_maxtimers < max) {
+			if (c->c_ntimers > 0) {
+				memcpy(heap, c->c_timers,
+				       c->c_ntimers * sizeof(*heap));
+			}
+			old = c->c_timers;
+			c->c_timers = heap;
+			c->c_maxtimers = max;
+		}
+		spinlock_release(&c->c_timer_lock);
+		kfree(old);
+	}
+
+	tm->tm_cpu = c;
+	c->c_timers[c->c_ntimers++] = tm;
+	heap_up(c, c->c_ntimers - 1);
+	first = tm->tm_index == 0;
+	spinlock_release(&c->c_timer_lock);
+
+	/* If it is now the first, the timer interrupt is set too late. */
+	if (first && clock_started) {
+		clock_program(clock_ns());
+	}
+	splx(spl);
+	return 0;
+}
+
+bool
+timer_cancel(struct timer *tm)
+{
+	struct cpu *c = tm->tm_cpu;
+	bool pending;
+
+	if (c == NULL) {
+		return false;
+	}
+	spinlock_acquire(&c->c_timer_lock);
+	pending = tm->tm_index != TIMER_IDLE;
+	if (pending) {
+		heap_remove(c, tm->tm_index);
+	}
+	spinlock_release(&c->c_timer_lock);
+
+	/*
+	 * If that was c's first timer, c's interrupt now comes early;
+	 * it will find nothing to do and set itself again.
+	 */
+	return pending;
+}
+
+/*
+ * Run the current cpu's timers that are due. Each function is called
+ * with the heap unlocked, and the timer is not touched after; the
+ * function may well free it.
+ */
+static
+void
+timer_expire(uint64_t now)
+{
+	struct cpu *c = curcpu->c_self;
+	struct timer *tm;
+	void (*func)(void *);
+	void *data;
+
+	spinlock_acquire(&c->c_timer_lock);
+	while (c->c_ntimers > 0 && c->c_timers[0]->tm_deadline <= now) {
+		tm = c->c_timers[0];
+		heap_remove(c, 0);
+		c->c_timersfired++;
+		func = tm->tm_func;
+		data = tm->tm_data;
+		spinlock_release(&c->c_timer_lock);
+		func(data);
+		spinlock_acquire(&c->c_timer_lock);
+	}
+	spinlock_release(&c->c_timer_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// The timer interrupt.
+//
+
+void
+clock_start(void)
+{
+	curcpu->c_nexttick = clock_ns() + NS_PER_HARDCLOCK;
+	clock_started = true;
+	mainbus_timer_set(NS_PER_HARDCLOCK);
+}
+
+void
+clock_interrupt(void)
+{
+	struct cpu *c = curcpu->c_self;
+	uint64_t now;
+	bool tick = false;
+
+	if (!clock_started) {
+		mainbus_timer_set(NS_PER_HARDCLOCK);
+		hardclock();
+		return;
+	}
+
+	now = clock_ns();
+	timer_expire(now);
+	if (!c->c_tickless && now >= c->c_nexttick) {
+		c->c_nexttick += NS_PER_HARDCLOCK;
+		if (c->c_nexttick <= now) {
+			/* late, or the first tick on this cpu */
+			c->c_nexttick = now + NS_PER_HARDCLOCK;
+		}
+		tick = true;
+	}
+
+	/* Set the next interrupt first: hardclock may switch threads. */
+	clock_program(now);
+	if (tick) {
+		hardclock();
+	}
+}
+
+/*
+ * Called from the idle loop before each cpu_idle(), with interrupts
+ * off. On the way in, stop the ticks; the cpu will wake for its
+ * first timer, or some other interrupt, or after CLOCK_IDLE_MAX.
+ */
+void
+clock_idle_enter(void)
+{
+	struct cpu *c = curcpu->c_self;
+	uint64_t now;
+
+	if (!clock_started || c->c_tickless) {
+		return;
+	}
+	now = clock_ns();
+	c->c_tickless = true;
+	c->c_idlestart = now;
+	c->c_idleperiods++;
+	clock_program(now);
+}
+
+/*
+ * Called when the idle loop has found a thread to run: start ticking
+ * again, a full tick from now.
+ */
+void
+clock_idle_exit(void)
+{
+	struct cpu *c = curcpu->c_self;
+	uint64_t now;
+
+	if (!c->c_tickless) {
+		return;
+	}
+	now = clock_ns();
+	c->c_ticksskipped += (now - c->c_idlestart) / NS_PER_HARDCLOCK;
+	c->c_tickless = false;
+	c->c_nexttick = now + NS_PER_HARDCLOCK;
+	clock_program(now);
 }
 
 /*
@@ -97,13 +465,84 @@ hardclock(void)
 	 */
 
 	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
-		thread_consider_migration();
-	}
 	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
 		schedule();
 	}
-	thread_yield();
+	if (thread_tick()) {
+		thread_yield();
+	}
+}
+
+/*
+ * Print per-cpu tick and timer counts.
+ */
+void
+clock_printstats(void)
+{
+	struct cpu *c;
+
+	kprintf("cpu  hardclocks  skipped  idles  pending    fired\n");
+	for (c = clockcpus; c != NULL; c = c->c_clocknext) {
+		kprintf("%3u %11u %8u %6u %8u %8u\n", c->c_number,
+			c->c_hardclocks, c->c_ticksskipped, c->c_idleperiods,
+			c->c_ntimers, c->c_timersfired);
+	}
+}
+
+/*
+ * Timed sleeps. The timer's function wakes the sleeper if it has gone
+ * to sleep yet, and in any case tells it the time has come.
+ */
+struct sleeper {
+	struct thread *s_thread;
+	bool s_sleeping;		/* on sleep_wchan */
+	bool s_expired;
+};
+
+static
+void
+sleeper_expire(void *data)
+{
+	struct sleeper *s = data;
+
+	spinlock_acquire(&sleep_lock);
+	s->s_expired = true;
+	if (s->s_sleeping) {
+		s->s_sleeping = false;
+		wchan_wakethread(sleep_wchan, &sleep_lock, s->s_thread);
+	}
+	spinlock_release(&sleep_lock);
+}
+
+int
+thread_sleep_until(uint64_t deadline)
+{
+	struct sleeper s;
+	struct timer tm;
+	int result;
+
+	KASSERT(clock_started);
+
+	if (deadline <= clock_ns()) {
+		return 0;
+	}
+
+	s.s_thread = curthread;
+	s.s_sleeping = false;
+	s.s_expired = false;
+	timer_init(&tm, sleeper_expire, &s);
+	result = timer_add(&tm, deadline);
+	if (result) {
+		return result;
+	}
+
+	spinlock_acquire(&sleep_lock);
+	while (!s.s_expired) {
+		s.s_sleeping = true;
+		wchan_sleep(sleep_wchan, &sleep_lock);
+	}
+	spinlock_release(&sleep_lock);
+	return 0;
 }
 
 /*
@@ -112,6 +551,13 @@ hardclock(void)
 void
 clocksleep(int num_secs)
 {
+	if (clock_started &&
+	    thread_sleep_until(clock_ns() +
+			       (uint64_t)num_secs * NS_PER_SEC) == 0) {
+		return;
+	}
+
+	/* No timers to be had; count seconds on lbolt instead. */
 	spinlock_acquire(&lbolt_lock);
 	while (num_secs > 0) {
 		wchan_sleep(lbolt, &lbolt_lock);
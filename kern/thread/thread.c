@@ -46,10 +46,13 @@
 #include <threadprivate.h>
 #include <proc.h>
 #include <current.h>
+#include <clock.h>
 #include <synch.h>
 #include <addrspace.h>
+#include <vm.h>
 #include <mainbus.h>
 #include <vnode.h>
+#include <objcache.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
@@ -75,6 +78,34 @@ unsigned thread_count = 0;
 static struct spinlock thread_count_lock = SPINLOCK_INITIALIZER;
 static struct wchan *thread_count_wchan;
 
+/* Where threads and wait channels come from. */
+static struct objcache *thread_cache;
+static struct objcache *wchan_cache;
+
+/* Every thread not yet destroyed, for thread_printsched. */
+static struct threadlist allthreads;
+static struct spinlock allthreads_lock = SPINLOCK_INITIALIZER;
+
+/*
+ * Scheduler tuning. A runnable thread that has waited
+ * SCHED_AGE_HARDCLOCKS without running is raised a level by
+ * schedule(), and again each time schedule() finds it still waiting,
+ * so nothing starves behind threads of higher priority.
+ */
+#define SCHED_AGE_HARDCLOCKS	20
+
+/*
+ * A thread that was running on its cpu less than this many hardclocks
+ * ago probably still has its working set in that cpu's cache, so an
+ * idle cpu steals it only if there is nothing colder to take.
+ */
+#define STEAL_HOT_HARDCLOCKS	2
+
+static void thread_kick_idle(struct cpu *busy);
+static struct thread *thread_steal(void);
+
+unsigned sched_quantum[SCHED_NLEVELS] = { 1, 2, 4, 8 };
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -129,7 +160,7 @@ thread_create(const char *name)
 		return NULL;
 	}
 
-	thread = kmalloc(sizeof(*thread));
+	thread = objcache_alloc(thread_cache);
 	if (thread == NULL) {
 		return NULL;
 	}
@@ -145,8 +176,18 @@ thread_create(const char *name)
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	threadlistnode_init(&thread->t_allnode, thread);
 	HANGMAN_ACTORINIT(&thread->t_hangman, thread->t_name);
 
+	/* Scheduler fields; new threads start at the top level */
+	thread->t_level = 0;
+	thread->t_quantum = sched_quantum[0];
+	thread->t_iowait = false;
+	thread->t_readystamp = 0;
+	thread->t_runticks = thread->t_waitticks = 0;
+	thread->t_runs = thread->t_ioboosts = 0;
+	thread->t_migrations = 0;
+
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
@@ -154,6 +195,10 @@ thread_create(const char *name)
 
 	/* If you add to struct thread, be sure to initialize here */
 
+	spinlock_acquire(&allthreads_lock);
+	threadlist_addtail(&allthreads, thread);
+	spinlock_release(&allthreads_lock);
+
 	return thread;
 }
 
@@ -179,15 +224,19 @@ cpu_create(unsigned hardware_number)
 
 	c->c_self = c;
 	c->c_hardware_number = hardware_number;
+	pagecache_init(c);
+	kmcache_init(c);
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
 	c->c_hardclocks = 0;
 	c->c_spinlocks = 0;
+	c->c_steals = c->c_stealtries = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	c->c_stolen = 0;
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
@@ -197,6 +246,8 @@ cpu_create(unsigned hardware_number)
 	if (result != 0) {
 		panic("cpu_create: array_add: %s\n", strerror(result));
 	}
+	tlbstate_init(c);
+	clock_cpu_init(c);
 
 	snprintf(namebuf, sizeof(namebuf), "<boot #%d>", c->c_number);
 	c->c_curthread = thread_create(namebuf);
@@ -280,13 +331,17 @@ thread_destroy(struct thread *thread)
 	if (thread->t_stack != NULL) {
 		kfree(thread->t_stack);
 	}
+	spinlock_acquire(&allthreads_lock);
+	threadlist_remove(&allthreads, thread);
+	spinlock_release(&allthreads_lock);
+	threadlistnode_cleanup(&thread->t_allnode);
 	threadlistnode_cleanup(&thread->t_listnode);
 	thread_machdep_cleanup(&thread->t_machdep);
 
 	/* sheer paranoia */
 	thread->t_wchan_name = "DESTROYED";
 
-	kfree(thread);
+	objcache_free(thread_cache, thread);
 }
 
 /*
@@ -374,6 +429,13 @@ void
 thread_bootstrap(void)
 {
 	cpuarray_init(&allcpus);
+	threadlist_init(&allthreads);
+
+	thread_cache = objcache_create("thread", sizeof(struct thread),
+				       NULL, NULL);
+	if (thread_cache == NULL) {
+		panic("thread_bootstrap: Out of memory\n");
+	}
 
 	/*
 	 * Create the cpu structure for the bootup CPU, the one we're
@@ -455,6 +517,28 @@ thread_start_cpus(void)
 	thread_count = 1;
 }
 
+/*
+ * Put a thread on a cpu's run queue: after the threads of its level
+ * or higher and before those of lower levels, so the queue stays in
+ * priority order and each level is round-robin.
+ */
+static
+void
+runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct thread *prev;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	THREADLIST_FORALL_REV(prev, c->c_runqueue) {
+		if (prev->t_level <= t->t_level) {
+			threadlist_insertafter(&c->c_runqueue, prev, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
 /*
  * Make a thread runnable.
  *
@@ -477,9 +561,17 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
+	/* A thread back from waiting for a device goes to the top. */
+	if (target->t_state == S_SLEEP && target->t_iowait) {
+		target->t_level = 0;
+		target->t_quantum = sched_quantum[0];
+		target->t_ioboosts++;
+	}
+
 	/* Target thread is now ready to run; put it on the run queue. */
 	target->t_state = S_READY;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	target->t_readystamp = targetcpu->c_hardclocks;
+	runqueue_insert(targetcpu, target);
 
 	if (targetcpu->c_isidle && targetcpu != curcpu->c_self) {
 		/*
@@ -488,6 +580,13 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (!targetcpu->c_isidle) {
+		/*
+		 * The thread has to wait; if some other processor
+		 * is idle, wake it up to come and take it.
+		 */
+		thread_kick_idle(targetcpu);
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
@@ -654,6 +753,11 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * Note that c_isidle becomes true briefly even if we don't go
 	 * idle. However, because one is supposed to hold the runqueue
 	 * lock to look at it, this should not be visible or matter.
+	 *
+	 * Before idling, try to steal a thread from another cpu's run
+	 * queue. We get another try every time an interrupt wakes us,
+	 * including the IPI thread_kick_idle sends. While idle the cpu
+	 * takes no hardclocks, only its timers' interrupts; see clock.c.
 	 */
 
 	/* The current cpu is now idle. */
@@ -662,11 +766,19 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 		next = threadlist_remhead(&curcpu->c_runqueue);
 		if (next == NULL) {
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				clock_idle_enter();
+				cpu_idle();
+			}
 			spinlock_acquire(&curcpu->c_runqueue_lock);
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
+	clock_idle_exit();
+
+	next->t_waitticks += curcpu->c_hardclocks - next->t_readystamp;
+	next->t_runs++;
 
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
@@ -847,139 +959,244 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * The run queue is kept in priority order as threads are put on it
+ * (runqueue_insert), and threads move between levels as they run
+ * (thread_tick) and wake up (thread_make_runnable). What is left for
+ * schedule(), which is called periodically from hardclock(), is to
+ * raise threads that have waited too long on the current CPU's run
+ * queue.
  */
 
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct thread *t, *next;
+	struct threadlist aged;
+	unsigned now;
+
+	threadlist_init(&aged);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	now = curcpu->c_hardclocks;
+	for (t = curcpu->c_runqueue.tl_head.tln_next->tln_self; t != NULL;
+	     t = next) {
+		next = t->t_listnode.tln_next->tln_self;
+		if (t->t_level > 0 &&
+		    now - t->t_readystamp >= SCHED_AGE_HARDCLOCKS) {
+			threadlist_remove(&curcpu->c_runqueue, t);
+			threadlist_addtail(&aged, t);
+		}
+	}
+	while ((t = threadlist_remhead(&aged)) != NULL) {
+		t->t_level--;
+		t->t_quantum = sched_quantum[t->t_level];
+		runqueue_insert(curcpu->c_self, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	threadlist_cleanup(&aged);
+}
+
+/*
+ * Called from hardclock() on every tick. A thread that uses up its
+ * quantum drops a level, unless it is already at the bottom; either
+ * way it goes to the back of its level. A thread is also preempted
+ * when something of higher priority is waiting, which is how a thread
+ * woken from a device wait gets the cpu from a compute-bound one
+ * within a tick.
+ */
+bool
+thread_tick(void)
+{
+	struct thread *cur, *head;
+	bool yield = false;
+
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	cur = curthread;
+	cur->t_runticks++;
+	if (cur->t_quantum > 1) {
+		cur->t_quantum--;
+	}
+	else {
+		if (cur->t_level < SCHED_NLEVELS - 1) {
+			cur->t_level++;
+		}
+		cur->t_quantum = sched_quantum[cur->t_level];
+		yield = true;
+	}
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	head = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	if (head != NULL && head->t_level < cur->t_level) {
+		yield = true;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return yield;
+}
+
+void
+thread_iowait(bool waiting)
+{
+	curthread->t_iowait = waiting;
+}
+
+/*
+ * Print each thread's level and what it has had of the cpu.
+ */
+void
+thread_printsched(void)
+{
+	static const char *const statenames[] = {
+		"run", "ready", "sleep", "zombie",
+	};
+	struct thread *t;
+	struct cpu *c;
+	unsigned i;
+
+	kprintf("Quantum by level (hardclocks):");
+	for (i=0; i<SCHED_NLEVELS; i++) {
+		kprintf(" %u", sched_quantum[i]);
+	}
+	kprintf("; %d hardclocks per second\n", HZ);
+
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		kprintf("cpu%u: %u threads stolen in %u tries, %u taken "
+			"by others\n", c->c_number, c->c_steals,
+			c->c_stealtries, c->c_stolen);
+	}
+
+	kprintf("thread               cpu state  level  runticks waitticks"
+		"    runs ioboosts migrations\n");
+	spinlock_acquire(&allthreads_lock);
+	THREADLIST_FORALL(t, allthreads) {
+		kprintf("%-20s %3d %-6s %5u %9u %9u %7u %8u %10u\n",
+			t->t_name, t->t_cpu != NULL ? (int)t->t_cpu->c_number : -1,
+			statenames[t->t_state], t->t_level, t->t_runticks,
+			t->t_waitticks, t->t_runs, t->t_ioboosts,
+			t->t_migrations);
+	}
+	spinlock_release(&allthreads_lock);
 }
 
 /*
  * Thread migration.
  *
- * This is also called periodically from hardclock(). If the current
- * CPU is busy and other CPUs are idle, or less busy, it should move
- * threads across to those other other CPUs.
+ * Threads move between cpus by work stealing: a cpu with nothing to
+ * run takes a thread from the cpu with the most threads waiting
+ * (thread_steal, from the idle loop in thread_switch). Busy cpus do
+ * nothing to balance themselves, so they pay nothing while all the
+ * cpus have work; when one of them queues a thread that has to wait,
+ * it wakes up an idle cpu to come and get it (thread_kick_idle).
  *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
- * which is fairly slow. The tradeoff between this performance loss
- * and the performance loss due to underutilization of some CPUs is
- * something that needs to be tuned and probably is workload-specific.
- *
- * For here and now, because we know we're running on System/161 and
- * System/161 does not (yet) model such cache effects, we'll be very
- * aggressive.
+ * which is fairly slow. So the thief prefers threads that have not
+ * run on their cpu for a while (see STEAL_HOT_HARDCLOCKS), and the
+ * lowest priority ones, which are the likeliest to be compute-bound
+ * and to run long enough on the new cpu to make the move worth it.
  */
+
+/*
+ * Wake up one idle cpu other than BUSY, if there is one. The look at
+ * c_isidle is unlocked, so an idle cpu can miss a kick. Idle cpus take
+ * no hardclocks, so the queued work may then wait until some other
+ * interrupt wakes one, which is at most CLOCK_IDLE_MAX (see clock.c).
+ */
+static
 void
-thread_consider_migration(void)
+thread_kick_idle(struct cpu *busy)
 {
-	unsigned my_count, total_count, one_share, to_send;
-	unsigned i, numcpus;
 	struct cpu *c;
-	struct threadlist victims;
-	struct thread *t;
+	unsigned i, numcpus;
 
-	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
 	for (i=0; i<numcpus; i++) {
 		c = cpuarray_get(&allcpus, i);
-		spinlock_acquire(&c->c_runqueue_lock);
-		total_count += c->c_runqueue.tl_count;
-		if (c == curcpu->c_self) {
-			my_count = c->c_runqueue.tl_count;
+		if (c != busy && c != curcpu->c_self && c->c_isidle) {
+			ipi_send(c, IPI_UNIDLE);
+			return;
 		}
-		spinlock_release(&c->c_runqueue_lock);
 	}
+}
 
-	one_share = DIVROUNDUP(total_count, numcpus);
-	if (my_count < one_share) {
-		return;
-	}
+/*
+ * Take a thread from the cpu with the longest run queue, for the
+ * current cpu to run. Called with no run queue locked. The queue
+ * lengths are read without locks, so that looking costs the other
+ * cpus nothing; only the victim's queue is locked, to take the
+ * thread.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	struct cpu *c, *victim;
+	struct thread *t, *cold, *hot;
+	unsigned i, numcpus, most;
 
-	to_send = my_count - one_share;
-	threadlist_init(&victims);
-	spinlock_acquire(&curcpu->c_runqueue_lock);
-	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+	victim = NULL;
+	most = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c != curcpu->c_self && c->c_runqueue.tl_count > most) {
+			most = c->c_runqueue.tl_count;
+			victim = c;
+		}
 	}
-	spinlock_release(&curcpu->c_runqueue_lock);
+	if (victim == NULL) {
+		return NULL;
+	}
+	curcpu->c_stealtries++;
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
-		c = cpuarray_get(&allcpus, i);
-		if (c == curcpu->c_self) {
+	cold = hot = NULL;
+	spinlock_acquire(&victim->c_runqueue_lock);
+	THREADLIST_FORALL_REV(t, victim->c_runqueue) {
+		/*
+		 * The victim's curthread can be on its run queue if
+		 * it was woken after the victim went idle, and must
+		 * not be moved; see thread_switch.
+		 */
+		if (t == victim->c_curthread) {
 			continue;
 		}
-		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
-				continue;
-			}
-
-			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
-			DEBUG(DB_THREADS,
-			      "Migrated thread %s: cpu %u -> %u",
-			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
-			if (c->c_isidle) {
-				/*
-				 * Other processor is idle; send
-				 * interrupt to make sure it unidles.
-				 */
-				ipi_send(c, IPI_UNIDLE);
-			}
+		/* New threads have nothing in any cache yet. */
+		if (t->t_runs == 0 || victim->c_hardclocks -
+		    t->t_readystamp >= STEAL_HOT_HARDCLOCKS) {
+			cold = t;
+			break;
 		}
-		spinlock_release(&c->c_runqueue_lock);
-	}
-
-	/*
-	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
-	 */
-	if (!threadlist_isempty(&victims)) {
-		spinlock_acquire(&curcpu->c_runqueue_lock);
-		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+		if (hot == NULL) {
+			hot = t;
 		}
-		spinlock_release(&curcpu->c_runqueue_lock);
 	}
+	/* Take a cache-hot thread only if the victim has others. */
+	if (cold == NULL && victim->c_runqueue.tl_count > 1) {
+		cold = hot;
+	}
+	if (cold != NULL) {
+		t = cold;
+		threadlist_remove(&victim->c_runqueue, t);
+		victim->c_stolen++;
+		t->t_waitticks += victim->c_hardclocks - t->t_readystamp;
+		t->t_readystamp = curcpu->c_hardclocks;
+		t->t_cpu = curcpu->c_self;
+		t->t_migrations++;
+	}
+	spinlock_release(&victim->c_runqueue_lock);
 
-	KASSERT(threadlist_isempty(&victims));
-	threadlist_cleanup(&victims);
+	if (cold == NULL) {
+		return NULL;
+	}
+	curcpu->c_steals++;
+	DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+	      cold->t_name, victim->c_number, curcpu->c_number);
+	return cold;
 }
 
 ////////////////////////////////////////////////////////////
@@ -988,6 +1205,43 @@ thread_consider_migration(void)
  * Wait channel functions
  */
 
+/*
+ * Wait channels live in an object cache that keeps their thread
+ * lists initialized; a wchan goes back to it empty.
+ */
+static
+int
+wchan_ctor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_init(&wc->wc_threads);
+	return 0;
+}
+
+static
+void
+wchan_dtor(void *obj)
+{
+	struct wchan *wc = obj;
+
+	threadlist_cleanup(&wc->wc_threads);
+}
+
+/*
+ * Set up the wait channel cache. This comes before anything else
+ * that creates locks or semaphores, starting with proc_bootstrap.
+ */
+void
+wchan_bootstrap(void)
+{
+	wchan_cache = objcache_create("wchan", sizeof(struct wchan),
+				      wchan_ctor, wchan_dtor);
+	if (wchan_cache == NULL) {
+		panic("wchan_bootstrap: Out of memory\n");
+	}
+}
+
 /*
  * Create a wait channel. NAME is a symbolic string name for it.
  * This is what's displayed by ps -alx in Unix.
@@ -1001,11 +1255,11 @@ wchan_create(const char *name)
 {
 	struct wchan *wc;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = objcache_alloc(wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
-	threadlist_init(&wc->wc_threads);
+	/* wc_threads is kept initialized by the cache */
 	wc->wc_name = name;
 
 	return wc;
@@ -1018,8 +1272,8 @@ wchan_create(const char *name)
 void
 wchan_destroy(struct wchan *wc)
 {
-	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	KASSERT(threadlist_isempty(&wc->wc_threads));
+	objcache_free(wchan_cache, wc);
 }
 
 /*
@@ -1074,6 +1328,18 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	thread_make_runnable(target, false);
 }
 
+/*
+ * Wake up a particular thread sleeping on a wait channel.
+ */
+void
+wchan_wakethread(struct wchan *wc, struct spinlock *lk, struct thread *t)
+{
+	KASSERT(spinlock_do_i_hold(lk));
+
+	threadlist_remove(&wc->wc_threads, t);
+	thread_make_runnable(t, false);
+}
+
 /*
  * Wake up all threads sleeping on a wait channel.
  */
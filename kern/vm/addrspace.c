@@ -27,6 +27,8 @@
  * SUCH DAMAGE.
  */
 
+#define ASINLINE
+
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
@@ -35,7 +37,17 @@
 #include <proc.h>
 #include <spl.h>
 #include <mips/tlb.h>
+#include <uio.h>
+#include <vnode.h>
+#include <kern/stat.h>
+#include <objcache.h>
+
+static int mmap_writeback(struct addrspace *as, struct region *r,
+			  vaddr_t start, vaddr_t end);
+static int region_insert(struct addrspace *as, struct region *r);
 
+unsigned int vm_heaplimit = HEAP_PAGES_DEFAULT;
+struct objcache *region_cache;
 
 
 struct addrspace *
@@ -57,8 +69,23 @@ as_create(void)
 		as->first->second_levels[i] = NULL;
 	}
 
-	as->regions = NULL;
+	as->regions = regionarray_create();
+	if (as->regions == NULL) {
+		kfree(as->first);
+		kfree(as);
+		return NULL;
+	}
+	as->last_region = NULL;
+	as->last_fault = 0;
 	as->heap = NULL;
+	as->stack = NULL;
+	as->heap_max = vm_heaplimit;
+	as->rss = 0;
+	as->swapped = 0;
+	as->pt_pages = 0;
+	as->loading = false;
+	as->tlb_tag = 0;
+	vm_tlbretag(as);
 
 	return as;
 }
@@ -73,68 +100,70 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
-	if (old->regions != NULL) {
-		newas->regions = kmalloc(sizeof(struct region));
-		if (newas->regions == NULL) {
+	newas->heap_max = old->heap_max;
+
+	unsigned num = regionarray_num(old->regions);
+	if (regionarray_preallocate(newas->regions, num)) {
+		as_destroy(newas);
+		return ENOMEM;
+	}
+	for (unsigned i = 0; i < num; i++) {
+		struct region *r = regionarray_get(old->regions, i);
+		struct region *copy = objcache_alloc(region_cache);
+		if (copy == NULL) {
+			as_destroy(newas);
 			return ENOMEM;
 		}
-		*(newas->regions) = *(old->regions);
-		struct region *new_region = newas->regions;
-		struct region *old_region = old->regions->next_region;
-		while (old_region != NULL) {
-			new_region->next_region = kmalloc(sizeof(struct region));
-			if (new_region->next_region == NULL) {
-				kfree(newas->regions);
-				return ENOMEM;
-			}
-			new_region = new_region->next_region;
-			*(new_region) = *(old_region);
-			old_region = old_region->next_region;
+		*copy = *r;
+		if (copy->reg_vnode != NULL) {
+			VOP_INCREF(copy->reg_vnode);
 		}
-		new_region->next_region = NULL;
-	}
-	if (old->heap != NULL) {
-		newas->heap = kmalloc(sizeof(struct region));
-		if (newas->heap == NULL) {
-			return ENOMEM;
+		regionarray_add(newas->regions, copy, NULL);
+		if (r == old->heap) {
+			newas->heap = copy;
+		} else if (r == old->stack) {
+			newas->stack = copy;
 		}
-		*(newas->heap) = *(old->heap);
 	}
 
-	for (unsigned i = 0; i < 1024; ++i) {
+	int result = 0;
+	for (unsigned i = 0; i < 1024 && result == 0; ++i) {
 		struct second_level_page_table *pt = (old->first)->second_levels[i];
 		if (pt == NULL) {
 			(newas->first)->second_levels[i] = NULL;
 		} else {
-			(newas->first)->second_levels[i] = kmalloc(sizeof(struct second_level_page_table));
-			if ((newas->first)->second_levels[i] == NULL) 
-				return ENOMEM;
-			for (int j = 0; j < 1024; ++j) {
-				struct page_table_entry *pte = pt->actual_pages[j];
-				if (pte == NULL) {
-					((newas->first)->second_levels[i])->actual_pages[j] = NULL;
-				} else {
-					struct page_table_entry *new_pte = kmalloc(sizeof(struct page_table_entry));
-					if (new_pte == NULL) {
-						return ENOMEM;
-					}
-					if (pte->is_valid && pte->base != 0) {
-						paddr_t new_pa = 0;
-						new_pa = allocate_one_page(1); //user page
-						if (new_pa == 0)
-							return ENOMEM;
-						new_pte->base = new_pa;
-						memmove((void *) PADDR_TO_KVADDR(new_pte->base),
-								(const void *) PADDR_TO_KVADDR(pte->base),
-								PAGE_SIZE);
-					}
-					((newas->first)->second_levels[i])->actual_pages[j] = new_pte;
-					new_pte->is_valid = pte->is_valid;
-				}
+			struct second_level_page_table *new_pt = kmalloc(sizeof(struct second_level_page_table));
+			if (new_pt == NULL) {
+				result = ENOMEM;
+				break;
+			}
+			bzero(new_pt, sizeof(*new_pt));
+			(newas->first)->second_levels[i] = new_pt;
+			newas->pt_pages++;
+			for (int j = 0; j < 1024 && result == 0; ++j) {
+				if (pt->entries[j] == 0)
+					continue;
+				/* frames are shared; whoever writes first copies */
+				result = pte_share(&pt->entries[j], &new_pt->entries[j], newas, (i << 22) | (j << 12));
 			}
 		}
 	}
 
+	/*
+	 * The parent's pages are read-only now, even if the copy failed
+	 * part way; drop its writable mappings.
+	 */
+	vm_tlbretag(old);
+	if (old == proc_getas()) {
+		vm_tlbshootdown_all();
+	}
+
+	if (result) {
+		/* gives back the shares taken so far */
+		as_destroy(newas);
+		return result;
+	}
+
 	*ret = newas;
 	return 0;
 }
@@ -142,30 +171,38 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
+	unsigned num = regionarray_num(as->regions);
+	for (unsigned i = 0; i < num; i++) {
+		struct region *r = regionarray_get(as->regions, i);
+		mmap_writeback(as, r, r->reg_start, r->reg_end);
+	}
+
 	for (unsigned i = 0; i < 1024; ++i) {
 		struct second_level_page_table *pt = (as->first)->second_levels[i];
 		if (pt != NULL) {
 			for (int j = 0; j < 1024; ++j) {
-				struct page_table_entry *pte = pt->actual_pages[j];
-				if (pte != NULL) {
-					if (pte->is_valid && pte->base != 0) {
-						free_kpages(PADDR_TO_KVADDR(pte->base));
-					}
-					kfree(pte);
+				if (pt->entries[j] != 0) {
+					pte_release(as, (i << 22) | (j << 12),
+						    &pt->entries[j]);
 				}
 			}
 			kfree(pt);
 		}
 	}
 
-	struct region *curr = as->regions;
-	while (curr != NULL) {
-		struct region *temp = curr;
-		curr = curr->next_region;
-		kfree(temp);
+	/* an eviction or page move of ours may still be finishing */
+	vm_pager_barrier();
+
+	for (unsigned i = 0; i < num; i++) {
+		struct region *r = regionarray_get(as->regions, i);
+		if (r->reg_vnode != NULL) {
+			VOP_DECREF(r->reg_vnode);
+		}
+		objcache_free(region_cache, r);
 	}
+	regionarray_setsize(as->regions, 0);
+	regionarray_destroy(as->regions);
 
-	kfree(as->heap);
 	kfree(as->first);
 	kfree(as);
 }
@@ -180,7 +217,7 @@ as_activate(void)
 		return;
 	}
 
-	vm_tlbshootdown_all();
+	vm_tlbactivate(as);
 }
 
 void
@@ -188,67 +225,109 @@ as_deactivate(void)
 {
 }
 
-int
-as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
-				 int readable, int writeable, int executable)
+static int
+define_segment(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+	       int perms, struct vnode *vn, off_t offset)
 {
-	(void) readable;
-	(void) writeable;
-	(void) executable;
 	size_t npages;
 
 	memsize += vaddr & ~(vaddr_t) PAGE_FRAME;
+	offset -= vaddr & ~(vaddr_t) PAGE_FRAME;
 	vaddr &= PAGE_FRAME;
 	memsize = (memsize + PAGE_SIZE - 1) & PAGE_FRAME;
 	npages = memsize / PAGE_SIZE;
-	struct region *new_region = kmalloc(sizeof(struct region));
-	new_region->next_region = NULL;
-	if (as->regions == NULL) {
-		as->regions = new_region;
-		as->heap = kmalloc(sizeof(struct region));
-		as->heap->npages = 1;
-		as->heap->next_region = NULL;
-		as->heap->reg_start = 0;
-		as->heap->reg_end = 0;
-	} else {
-		struct region *curr = as->regions;
-		while (curr->next_region != NULL) {
-			curr = curr->next_region;
-		}
-		curr->next_region = new_region;
+	struct region *new_region = objcache_alloc(region_cache);
+	if (new_region == NULL) {
+		return ENOMEM;
 	}
 	new_region->npages = npages;
-
+	new_region->reg_type = REGION_SEGMENT;
+	new_region->reg_perms = perms;
+	new_region->reg_vnode = vn;
+	new_region->reg_offset = vn != NULL ? offset : 0;
+	new_region->reg_shared = false;
 	new_region->reg_start = vaddr;
 	new_region->reg_end = vaddr + npages * PAGE_SIZE;
-	if (new_region->reg_end > as->heap->reg_start) {
-		as->heap->reg_start = as->heap->reg_end = new_region->reg_end + PAGE_SIZE;
-	}
 
+	int result = region_insert(as, new_region);
+	if (result) {
+		objcache_free(region_cache, new_region);
+		return result;
+	}
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
 	return 0;
 }
 
 int
-as_prepare_load(struct addrspace *as)
+as_define_region(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+				 int readable, int writeable, int executable)
 {
-	struct region *curr = as->regions;
-	while (curr != NULL) {
-		if (alloc_region(as->first, curr->reg_start, curr->npages, POSITIVE)) { 
-			return ENOMEM;
-		}
-		curr = curr->next_region;
-	}
+	return define_segment(as, vaddr, memsize,
+		(readable ? REG_READ : 0) | (writeable ? REG_WRITE : 0) |
+		(executable ? REG_EXEC : 0), NULL, 0);
+}
 
+/*
+ * A read-only segment whose pages come straight from the file at
+ * offset (the file offset of vaddr). Its pages are read in on first
+ * touch and shared with every other process running the same file.
+ */
+int
+as_define_text(struct addrspace *as, vaddr_t vaddr, size_t memsize,
+	       int readable, int executable, struct vnode *vn, off_t offset)
+{
+	return define_segment(as, vaddr, memsize,
+		(readable ? REG_READ : 0) | (executable ? REG_EXEC : 0),
+		vn, offset);
+}
+
+/*
+ * Page tables are filled in lazily by vm_fault, so there is nothing to
+ * set up here; loading only needs the segments to be writable until
+ * as_complete_load.
+ */
+int
+as_prepare_load(struct addrspace *as)
+{
+	as->loading = true;
 	return 0;
 }
 
+/*
+ * The heap starts out empty, a page above the highest segment.
+ */
 int
 as_complete_load(struct addrspace *as)
 {
-	struct region *curr = as->regions;
-	while (curr != NULL) {
-		alloc_region(as->first, curr->reg_start, curr->npages, POSITIVE);
-		curr = curr->next_region;
+	unsigned num = regionarray_num(as->regions);
+	if (as->heap == NULL && num > 0) {
+		struct region *last = regionarray_get(as->regions, num - 1);
+		as->heap = objcache_alloc(region_cache);
+		if (as->heap == NULL) {
+			return ENOMEM;
+		}
+		as->heap->reg_start = as->heap->reg_end = last->reg_end + PAGE_SIZE;
+		as->heap->npages = 0;
+		as->heap->reg_type = REGION_HEAP;
+		as->heap->reg_perms = REG_READ | REG_WRITE;
+		as->heap->reg_vnode = NULL;
+		as->heap->reg_offset = 0;
+		as->heap->reg_shared = false;
+		int result = region_insert(as, as->heap);
+		if (result) {
+			objcache_free(region_cache, as->heap);
+			as->heap = NULL;
+			return result;
+		}
+	}
+
+	as->loading = false;
+	/* text pages may have been entered writable while loading */
+	vm_tlbretag(as);
+	if (as == proc_getas()) {
+		vm_tlbshootdown_all();
 	}
 	return 0;
 }
@@ -256,63 +335,359 @@ as_complete_load(struct addrspace *as)
 int
 as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 {
-	as->stack_top = USERSTACK;
-	as->stack_bottom = USERSTACK - 3000 * PAGE_SIZE;
+	if (as->stack == NULL) {
+		struct region *stack = objcache_alloc(region_cache);
+		if (stack == NULL) {
+			return ENOMEM;
+		}
+		stack->npages = STACK_PAGES;
+		stack->reg_start = USERSTACK - STACK_PAGES * PAGE_SIZE;
+		stack->reg_end = USERSTACK;
+		stack->reg_type = REGION_STACK;
+		stack->reg_perms = REG_READ | REG_WRITE;
+		stack->reg_vnode = NULL;
+		stack->reg_offset = 0;
+		stack->reg_shared = false;
+		int result = region_insert(as, stack);
+		if (result) {
+			objcache_free(region_cache, stack);
+			return result;
+		}
+		as->stack = stack;
+	}
 	*stackptr = USERSTACK;
 	return 0;
 }
 
+/*
+ * Index of the first region starting above vaddr. Regions never
+ * overlap, so the one containing vaddr, if any, is just before it.
+ */
+static unsigned region_search(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned lo = 0, hi = regionarray_num(as->regions);
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (regionarray_get(as->regions, mid)->reg_start <= vaddr) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
 
-struct page_table_entry *find_pte(struct first_level_page_table *first, vaddr_t vaddr)
+/* Add r to the region index, keeping it sorted. */
+static int region_insert(struct addrspace *as, struct region *r)
 {
-	struct second_level_page_table *pt = first->second_levels[(vaddr) >> 22];
-	if (pt == NULL) return NULL;
-	struct page_table_entry *pte = pt->actual_pages[(vaddr & 0x003FFFFF) >> 12];
-	return pte;
+	unsigned pos = region_search(as, r->reg_start);
+	unsigned num = regionarray_num(as->regions);
+	int result = regionarray_setsize(as->regions, num + 1);
+	if (result) {
+		return result;
+	}
+	for (unsigned i = num; i > pos; i--) {
+		regionarray_set(as->regions, i, regionarray_get(as->regions, i - 1));
+	}
+	regionarray_set(as->regions, pos, r);
+	return 0;
 }
 
-void dealloc_pt(struct first_level_page_table *first, vaddr_t vaddr)
+static void region_remove(struct addrspace *as, unsigned index)
 {
-	struct page_table_entry *pte = find_pte(first, vaddr);
-	if (pte == NULL) return;
-	if (pte->is_valid) {
-		free_kpages(PADDR_TO_KVADDR(pte->base));
+	if (as->last_region == regionarray_get(as->regions, index)) {
+		as->last_region = NULL;
 	}
-	first->second_levels[(vaddr) >> 22] = NULL;
-	kfree(pte);
+	regionarray_remove(as->regions, index);
 }
 
-int alloc_region(struct first_level_page_table *first, vaddr_t vaddr, size_t npages, enum direction_alloc direction)
+/*
+ * Find the region containing vaddr: a loaded segment, the heap, the
+ * stack or an mmap region. NULL if vaddr is not mapped. Faults tend
+ * to come in runs in the same region, so check the last hit first.
+ */
+struct region *as_find_region(struct addrspace *as, vaddr_t vaddr)
 {
-	vaddr_t curr = vaddr;
-	for (size_t i = 0; i < npages; ++i) {
-		struct second_level_page_table *pt = first->second_levels[(curr) >> 22];
-		if (pt == NULL) {
-			pt = kmalloc(sizeof(struct second_level_page_table));
-			if (pt == NULL) {
+	struct region *r = as->last_region;
+	if (r != NULL && vaddr >= r->reg_start && vaddr < r->reg_end) {
+		return r;
+	}
+	unsigned i = region_search(as, vaddr);
+	if (i == 0) {
+		return NULL;
+	}
+	r = regionarray_get(as->regions, i - 1);
+	if (vaddr >= r->reg_end) {
+		return NULL;
+	}
+	as->last_region = r;
+	return r;
+}
+
+static bool region_overlaps(struct region *r, vaddr_t start, vaddr_t end)
+{
+	return r != NULL && start < r->reg_end && end > r->reg_start;
+}
+
+/*
+ * The first region overlapping [start, end), skipping mmap regions
+ * unless with_mmaps is set.
+ */
+static struct region *region_overlap(struct addrspace *as, vaddr_t start,
+				     vaddr_t end, bool with_mmaps)
+{
+	unsigned num = regionarray_num(as->regions);
+	unsigned i = region_search(as, start);
+	for (i = i > 0 ? i - 1 : 0; i < num; i++) {
+		struct region *r = regionarray_get(as->regions, i);
+		if (r->reg_start >= end) {
+			break;
+		}
+		if ((with_mmaps || r->reg_type != REGION_MMAP) &&
+		    region_overlaps(r, start, end)) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+static struct region *as_fixed_overlap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	return region_overlap(as, start, end, false);
+}
+
+static struct region *as_overlap(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	return region_overlap(as, start, end, true);
+}
+
+/* True if nothing is mapped anywhere in [start, end). */
+bool as_range_free(struct addrspace *as, vaddr_t start, vaddr_t end)
+{
+	return as_overlap(as, start, end) == NULL;
+}
+
+/*
+ * Write the pages of a shared, writable file mapping in [start, end)
+ * back to the file. Only pages written since they were read from the
+ * file go back, so a page that was only read cannot overwrite newer
+ * data in the file; nothing past the current end of file is written.
+ */
+static int mmap_writeback(struct addrspace *as, struct region *r,
+			  vaddr_t start, vaddr_t end)
+{
+	struct stat st;
+	struct iovec iov;
+	struct uio u;
+	int result;
+
+	if (r->reg_type != REGION_MMAP || r->reg_vnode == NULL ||
+	    !r->reg_shared || !(r->reg_perms & REG_WRITE)) {
+		return 0;
+	}
+	result = VOP_STAT(r->reg_vnode, &st);
+	if (result) {
+		return result;
+	}
+	void *buf = (void *) alloc_kpages(1);
+	if (buf == NULL) {
+		return ENOMEM;
+	}
+	for (vaddr_t va = start; va < end; va += PAGE_SIZE) {
+		off_t off = r->reg_offset + (va - r->reg_start);
+		if (off >= st.st_size) {
+			break;
+		}
+		bool modified;
+		if (!vm_copypage(as, va, buf, &modified) || !modified) {
+			continue;
+		}
+		size_t len = st.st_size - off < PAGE_SIZE ? st.st_size - off : PAGE_SIZE;
+		uio_kinit(&iov, &u, buf, len, off, UIO_WRITE);
+		result = VOP_WRITE(r->reg_vnode, &u);
+		if (result) {
+			break;
+		}
+	}
+	free_kpages((vaddr_t) buf);
+	return result;
+}
+
+/*
+ * Add an mmap region of len bytes. With fixed, it goes exactly at *addr
+ * and replaces any mmap region there; otherwise it goes in the highest
+ * free gap below the stack. vn is NULL for anonymous memory.
+ */
+int as_define_mmap(struct addrspace *as, vaddr_t *addr, size_t len,
+		   int perms, bool fixed,
+		   struct vnode *vn, off_t offset, bool shared)
+{
+	vaddr_t start, end;
+	int result;
+
+	len = ROUNDUP(len, PAGE_SIZE);
+	if (len == 0 || len > USERSPACETOP) {
+		return EINVAL;
+	}
+	if (fixed) {
+		start = *addr;
+		end = start + len;
+		if ((start & ~(vaddr_t) PAGE_FRAME) || start == 0 ||
+		    end < start || end > USERSPACETOP) {
+			return EINVAL;
+		}
+		result = as_unmap(as, start, len);
+		if (result) {
+			return result;
+		}
+	} else {
+		end = as->stack->reg_start;
+		while (1) {
+			if (end < len + PAGE_SIZE) {
 				return ENOMEM;
 			}
-			for (int j = 0; j < 1024; ++j) {
-				pt->actual_pages[j] = NULL;
+			start = end - len;
+			struct region *r = as_overlap(as, start, end);
+			if (r == NULL) {
+				break;
 			}
-			first->second_levels[curr >> 22] = pt;
+			end = r->reg_start;
 		}
+	}
 
-		struct page_table_entry *pte = pt->actual_pages[(curr & 0x003FFFFF) >> 12];
-		if (pte == NULL) {
-			pte = kmalloc(sizeof(struct page_table_entry));
-			if (pte == NULL) {
+	struct region *r = objcache_alloc(region_cache);
+	if (r == NULL) {
+		return ENOMEM;
+	}
+	r->reg_start = start;
+	r->reg_end = end;
+	r->npages = len / PAGE_SIZE;
+	r->reg_type = REGION_MMAP;
+	r->reg_perms = perms;
+	r->reg_vnode = vn;
+	r->reg_offset = offset;
+	r->reg_shared = shared;
+	result = region_insert(as, r);
+	if (result) {
+		objcache_free(region_cache, r);
+		return result;
+	}
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+
+	*addr = start;
+	return 0;
+}
+
+/*
+ * Remove whatever mmap regions lie in [addr, addr + len), splitting
+ * regions that only partly overlap. Ranges with nothing mapped are
+ * fine; ranges touching the segments, heap or stack are not.
+ */
+int as_unmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	vaddr_t end = ROUNDUP(addr + len, PAGE_SIZE);
+	int result;
+
+	if ((addr & ~(vaddr_t) PAGE_FRAME) || len == 0 ||
+	    end <= addr || end > USERSPACETOP) {
+		return EINVAL;
+	}
+	if (as_fixed_overlap(as, addr, end) != NULL) {
+		return EINVAL;
+	}
+
+	unsigned i = region_search(as, addr);
+	for (i = i > 0 ? i - 1 : 0; i < regionarray_num(as->regions); i++) {
+		struct region *r = regionarray_get(as->regions, i);
+		if (r->reg_start >= end) {
+			break;
+		}
+		vaddr_t s = addr > r->reg_start ? addr : r->reg_start;
+		vaddr_t e = end < r->reg_end ? end : r->reg_end;
+		if (r->reg_type != REGION_MMAP || s >= e) {
+			continue;
+		}
+
+		/* make sure a split cannot fail halfway through */
+		struct region *upper = NULL;
+		if (s > r->reg_start && e < r->reg_end) {
+			upper = objcache_alloc(region_cache);
+			if (upper == NULL) {
 				return ENOMEM;
 			}
-			pt->actual_pages[(curr & 0x003FFFFF) >> 12] = pte;
-			pte->is_valid = 0;
-			pte->base = 0;
+			result = regionarray_preallocate(as->regions,
+						 regionarray_num(as->regions) + 1);
+			if (result) {
+				objcache_free(region_cache, upper);
+				return result;
+			}
 		}
-		if(direction == POSITIVE)
-			curr += PAGE_SIZE;
-		else
-			curr -= PAGE_SIZE;
+		result = mmap_writeback(as, r, s, e);
+		if (result) {
+			if (upper != NULL) {
+				objcache_free(region_cache, upper);
+			}
+			return result;
+		}
+
+		vm_tlbshootdown_range(as, s, (e - s) / PAGE_SIZE);
+		pte_release_range(as, s, (e - s) / PAGE_SIZE);
 
+		if (s == r->reg_start && e == r->reg_end) {
+			region_remove(as, i);
+			if (r->reg_vnode != NULL) {
+				VOP_DECREF(r->reg_vnode);
+			}
+			objcache_free(region_cache, r);
+			i--;
+			continue;
+		}
+		if (upper != NULL) {
+			*upper = *r;
+			upper->reg_start = e;
+			upper->reg_offset += e - r->reg_start;
+			upper->npages = (upper->reg_end - e) / PAGE_SIZE;
+			r->reg_end = s;
+			if (r->reg_vnode != NULL) {
+				VOP_INCREF(r->reg_vnode);
+			}
+			/* cannot fail: preallocated above */
+			region_insert(as, upper);
+		} else if (s == r->reg_start) {
+			r->reg_offset += e - r->reg_start;
+			r->reg_start = e;
+		} else {
+			r->reg_end = s;
+		}
+		r->npages = (r->reg_end - r->reg_start) / PAGE_SIZE;
 	}
 	return 0;
-}
\ No newline at end of file
+}
+
+pte_t *find_pte(struct first_level_page_table *first, vaddr_t vaddr)
+{
+	struct second_level_page_table *pt = first->second_levels[PT1_INDEX(vaddr)];
+	if (pt == NULL) return NULL;
+	return &pt->entries[PT2_INDEX(vaddr)];
+}
+
+/*
+ * Like find_pte, but creates the second-level table on first use.
+ * NULL if out of memory.
+ */
+pte_t *alloc_pte(struct addrspace *as, vaddr_t vaddr)
+{
+	struct second_level_page_table *pt = as->first->second_levels[PT1_INDEX(vaddr)];
+	if (pt == NULL) {
+		pt = kmalloc(sizeof(struct second_level_page_table));
+		if (pt == NULL) {
+			return NULL;
+		}
+		bzero(pt, sizeof(*pt));
+		as->first->second_levels[PT1_INDEX(vaddr)] = pt;
+		as->pt_pages++;
+	}
+	return &pt->entries[PT2_INDEX(vaddr)];
+}
@@ -30,7 +30,10 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <objcache.h>
 #include <kern/test161.h>
 #include <test.h>
 
@@ -113,6 +116,10 @@ fill_deadbeef(void *vptr, size_t len)
  * CHECKGUARDS checks that allocated blocks' guard bands are intact
  * when checking kernel heap pages with SLOW and SLOWER. This is also
  * quite slow in its own right.
+ *
+ * MAGAZINES puts the per-cpu magazine layer in front of the subpage
+ * allocator. It is turned off by GUARDS and LABELS, which need to see
+ * every allocation and free.
  */
 
 #undef  SLOW
@@ -123,12 +130,27 @@ fill_deadbeef(void *vptr, size_t len)
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+#define MAGAZINES
+#if defined(GUARDS) || defined(LABELS)
+#undef MAGAZINES
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
 
-#define NSIZES 8
-static const size_t sizes[NSIZES] = { 16, 32, 64, 128, 256, 512, 1024, 2048 };
+/*
+ * Each size is the largest multiple of 8 that fits some number of
+ * blocks on a page, so little is left over at the end of a page. The
+ * steps are 8 or 16 bytes up to 128 and then at most a third of the
+ * size above, bar the last. The histogram in kheap_printfrag shows
+ * what the kernel actually asks for, to retune these by.
+ */
+#define NSIZES KM_NCLASSES
+static const size_t sizes[NSIZES] = {
+	16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160,
+	192, 224, 256, 288, 336, 408, 512, 680, 816, 1024, 1360, 2048
+};
 
 #define SMALLEST_SUBPAGE_SIZE 16
 #define LARGEST_SUBPAGE_SIZE 2048
@@ -162,10 +184,8 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the whole thing. Most traffic never gets here,
+ * as the per-cpu magazine layer (below) takes it first.
  */
 
 static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
@@ -799,6 +819,8 @@ subpage_stats(struct pageref *pr, bool quiet)
 	return ((unsigned long)sizes[blktype] * (n - (unsigned) pr->nfree));
 }
 
+static void kheap_printcaches(void);
+
 /*
  * Print the whole heap.
  */
@@ -807,6 +829,9 @@ kheap_printstats(void)
 {
 	struct pageref *pr;
 
+	kheap_printcaches();
+	kheap_reclaim();
+
 	/* print the whole thing with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 
@@ -830,6 +855,9 @@ kheap_getused(void) {
 	unsigned long total = 0;
 	unsigned int num_pages = 0, coremap_bytes = 0;
 
+	/* blocks sitting in magazines are free, not used */
+	kheap_reclaim();
+
 	/* compute with interrupts off */
 	spinlock_acquire(&kmalloc_spinlock);
 	for (pr = allbase; pr != NULL; pr = pr->next_all) {
@@ -894,24 +922,30 @@ remove_lists(struct pageref *pr, int blktype)
 
 /*
  * Given a requested client size, return the block type, that is, the
- * index into the sizes[] array for the block size to use.
+ * index into the sizes[] array for the block size to use. kmalloc
+ * sends anything bigger than LARGEST_SUBPAGE_SIZE elsewhere.
  */
 static
 inline
 int blocktype(size_t clientsz)
 {
-	unsigned i;
-	for (i=0; i<NSIZES; i++) {
-		if (clientsz <= sizes[i]) {
-			return i;
+	unsigned lo = 0, hi = NSIZES - 1, mid;
+
+	if (clientsz > LARGEST_SUBPAGE_SIZE) {
+		panic("Subpage allocator cannot handle allocation of size %zu\n",
+		      clientsz);
+	}
+	/* the first size that holds it */
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (sizes[mid] < clientsz) {
+			lo = mid + 1;
+		}
+		else {
+			hi = mid;
 		}
 	}
-
-	panic("Subpage allocator cannot handle allocation of size %zu\n",
-	      clientsz);
-
-	// keep compiler happy
-	return 0;
+	return lo;
 }
 
 /*
@@ -1036,6 +1070,7 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	kpage_settag(prpage, blktype + 1);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1190,6 +1225,7 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
+		kpage_settag(prpage, 0);
 		/* Call free_kpages without kmalloc_spinlock. */
 		spinlock_release(&kmalloc_spinlock);
 		free_kpages(prpage);
@@ -1210,18 +1246,855 @@ subpage_kfree(void *ptr)
 //
 ////////////////////////////////////////////////////////////
 
+////////////////////////////////////////////////////////////
+//
+// Magazine layer.
+//
+// Each cpu keeps, per size class, a loaded and a previous magazine:
+// a small stack of free blocks (struct kmcache, in struct cpu).
+// kmalloc pops from the loaded magazine and kfree pushes onto it.
+// When it runs dry or fills up it is swapped with the previous one,
+// and when that does not help either the cpu trades a magazine with
+// the depot, which keeps lists of full and empty magazines for each
+// size class. Only depot trades and the misses that fall through to
+// the pages take a global lock, and a trade moves KM_MAGSIZE blocks.
+//
+// Blocks in magazines are still allocated as far as the pages are
+// concerned; kheap_reclaim hands them all back. The magazines are
+// themselves subpage blocks.
+//
+
+#define KM_MAGSIZE	14	/* blocks per magazine, to fill 64 bytes */
+#define KM_DEPOT_MAX	8	/* full magazines kept per size class */
+
+struct km_magazine {
+	struct km_magazine *mag_next;	/* depot and reclaim lists */
+	unsigned mag_rounds;
+	void *mag_objs[KM_MAGSIZE];
+};
+
+struct km_depot {
+	struct km_magazine *d_full;
+	struct km_magazine *d_empty;
+	unsigned d_nfull;
+	unsigned d_nempty;
+};
+
+/* Lock order: kc_lock, then depot_lock, then kmalloc_spinlock. */
+static struct spinlock depot_lock = SPINLOCK_INITIALIZER;
+static struct km_depot depots[NSIZES];
+static struct kmcache *kmcaches;
+
+void
+kmcache_init(struct cpu *c)
+{
+	struct kmcache *kc = &c->c_kmcache;
+	unsigned i;
+
+	spinlock_init(&kc->kc_lock);
+	for (i=0; i<NSIZES; i++) {
+		kc->kc_loaded[i] = NULL;
+		kc->kc_previous[i] = NULL;
+	}
+	kc->kc_hits = kc->kc_misses = kc->kc_trades = 0;
+	for (i=0; i<KM_HISTBUCKETS; i++) {
+		kc->kc_hist[i] = 0;
+	}
+	kc->kc_asked = kc->kc_given = 0;
+	kc->kc_countdown = 0;		/* sample the first allocation */
+	kc->kc_nsamples = 0;
+	kc->kc_cpu = c;
+
+	spinlock_acquire(&depot_lock);
+	kc->kc_next = kmcaches;
+	kmcaches = kc;
+	spinlock_release(&depot_lock);
+}
+
+#ifdef MAGAZINES
+
+static
+struct km_magazine *
+depot_take(struct km_magazine **list, unsigned *count)
+{
+	struct km_magazine *mag = *list;
+
+	KASSERT(spinlock_do_i_hold(&depot_lock));
+	if (mag != NULL) {
+		*list = mag->mag_next;
+		(*count)--;
+	}
+	return mag;
+}
+
+static
+void
+depot_put(struct km_magazine **list, unsigned *count, struct km_magazine *mag)
+{
+	KASSERT(spinlock_do_i_hold(&depot_lock));
+	mag->mag_next = *list;
+	*list = mag;
+	(*count)++;
+}
+
+/*
+ * Take a block of size class BLKTYPE from this cpu's magazines, or
+ * return NULL if they and the depot have none.
+ */
+static
+void *
+magazine_alloc(int blktype)
+{
+	struct kmcache *kc;
+	struct km_depot *d = &depots[blktype];
+	struct km_magazine *mag, *prev, *full;
+	void *ret = NULL;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+	kc = &curcpu->c_kmcache;
+
+	spinlock_acquire(&kc->kc_lock);
+	mag = kc->kc_loaded[blktype];
+	if (mag == NULL || mag->mag_rounds == 0) {
+		prev = kc->kc_previous[blktype];
+		if (prev != NULL && prev->mag_rounds > 0) {
+			kc->kc_previous[blktype] = mag;
+			kc->kc_loaded[blktype] = prev;
+		}
+		else {
+			/* both empty: swap the previous one for a full one */
+			spinlock_acquire(&depot_lock);
+			full = depot_take(&d->d_full, &d->d_nfull);
+			if (full != NULL) {
+				if (prev != NULL) {
+					depot_put(&d->d_empty, &d->d_nempty, prev);
+				}
+				kc->kc_previous[blktype] = mag;
+				kc->kc_loaded[blktype] = full;
+				kc->kc_trades++;
+			}
+			spinlock_release(&depot_lock);
+		}
+		mag = kc->kc_loaded[blktype];
+	}
+	if (mag != NULL && mag->mag_rounds > 0) {
+		ret = mag->mag_objs[--mag->mag_rounds];
+		kc->kc_hits++;
+	}
+	else {
+		kc->kc_misses++;
+	}
+	spinlock_release(&kc->kc_lock);
+	return ret;
+}
+
+/*
+ * Put the block at PTR, on a page of size class BLKTYPE, in this
+ * cpu's magazines. Returns false if there was no room, in which case
+ * the caller frees it to its page.
+ */
+static
+bool
+magazine_free(int blktype, void *ptr)
+{
+	struct kmcache *kc;
+	struct km_depot *d = &depots[blktype];
+	struct km_magazine *mag, *prev, *empty;
+	bool want_empty = false;
+	bool ret = false;
+
+	if (!CURCPU_EXISTS()) {
+		return false;
+	}
+	if ((vaddr_t)ptr % PAGE_SIZE % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+	kc = &curcpu->c_kmcache;
+
+	spinlock_acquire(&kc->kc_lock);
+	mag = kc->kc_loaded[blktype];
+	if (mag == NULL || mag->mag_rounds == KM_MAGSIZE) {
+		prev = kc->kc_previous[blktype];
+		if (prev != NULL && prev->mag_rounds < KM_MAGSIZE) {
+			kc->kc_previous[blktype] = mag;
+			kc->kc_loaded[blktype] = prev;
+		}
+		else {
+			/* both full: swap the previous one for an empty one */
+			spinlock_acquire(&depot_lock);
+			empty = NULL;
+			if (prev == NULL || d->d_nfull < KM_DEPOT_MAX) {
+				empty = depot_take(&d->d_empty, &d->d_nempty);
+				want_empty = (empty == NULL);
+			}
+			if (empty != NULL) {
+				if (prev != NULL) {
+					depot_put(&d->d_full, &d->d_nfull, prev);
+				}
+				kc->kc_previous[blktype] = mag;
+				kc->kc_loaded[blktype] = empty;
+				kc->kc_trades++;
+			}
+			spinlock_release(&depot_lock);
+		}
+		mag = kc->kc_loaded[blktype];
+	}
+	if (mag != NULL && mag->mag_rounds < KM_MAGSIZE) {
+		fill_deadbeef(ptr, sizes[blktype]);
+		mag->mag_objs[mag->mag_rounds++] = ptr;
+		kc->kc_hits++;
+		ret = true;
+	}
+	else {
+		kc->kc_misses++;
+	}
+	spinlock_release(&kc->kc_lock);
+
+	if (want_empty) {
+		/*
+		 * Out of empty magazines. Make one for next time, with
+		 * no locks held as this may need a page.
+		 */
+		empty = subpage_kmalloc(sizeof(*empty));
+		if (empty != NULL) {
+			empty->mag_rounds = 0;
+			spinlock_acquire(&depot_lock);
+			depot_put(&d->d_empty, &d->d_nempty, empty);
+			spinlock_release(&depot_lock);
+		}
+	}
+	return ret;
+}
+
+/*
+ * Free a list of magazines linked through mag_next, and the blocks in
+ * them, to the pages.
+ */
+static
+void
+magazine_flush(struct km_magazine *mag)
+{
+	struct km_magazine *next;
+	int result;
+
+	for (; mag != NULL; mag = next) {
+		next = mag->mag_next;
+		while (mag->mag_rounds > 0) {
+			result = subpage_kfree(mag->mag_objs[--mag->mag_rounds]);
+			KASSERT(result == 0);
+		}
+		result = subpage_kfree(mag);
+		KASSERT(result == 0);
+	}
+	(void)result;
+}
+
+#endif /* MAGAZINES */
+
+/*
+ * Give back empty object cache slabs, then empty every cpu's
+ * magazines and the depot back into the pages.
+ */
+void
+kheap_reclaim(void)
+{
+#ifdef MAGAZINES
+	struct km_magazine *list = NULL, *mag;
+	struct kmcache *kc;
+	unsigned i;
+#endif
+
+	objcache_reap();
+
+#ifdef MAGAZINES
+
+	for (kc = kmcaches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		for (i=0; i<NSIZES; i++) {
+			if ((mag = kc->kc_loaded[i]) != NULL) {
+				mag->mag_next = list;
+				list = mag;
+			}
+			if ((mag = kc->kc_previous[i]) != NULL) {
+				mag->mag_next = list;
+				list = mag;
+			}
+			kc->kc_loaded[i] = kc->kc_previous[i] = NULL;
+		}
+		spinlock_release(&kc->kc_lock);
+	}
+
+	spinlock_acquire(&depot_lock);
+	for (i=0; i<NSIZES; i++) {
+		while ((mag = depot_take(&depots[i].d_full,
+					 &depots[i].d_nfull)) != NULL) {
+			mag->mag_next = list;
+			list = mag;
+		}
+		while ((mag = depot_take(&depots[i].d_empty,
+					 &depots[i].d_nempty)) != NULL) {
+			mag->mag_next = list;
+			list = mag;
+		}
+	}
+	spinlock_release(&depot_lock);
+
+	magazine_flush(list);
+#endif
+}
+
+/*
+ * Print the magazine layer's hit rates and depot contents.
+ */
+static
+void
+kheap_printcaches(void)
+{
+	struct kmcache *kc;
+	unsigned i, total;
+
+	kprintf("Magazine layer:\n");
+	for (kc = kmcaches; kc != NULL; kc = kc->kc_next) {
+		total = kc->kc_hits + kc->kc_misses;
+		kprintf("cpu%u: %u hits, %u misses (%u%% hit), %u depot trades\n",
+			kc->kc_cpu->c_number, kc->kc_hits, kc->kc_misses,
+			total ? kc->kc_hits * 100 / total : 0, kc->kc_trades);
+	}
+	spinlock_acquire(&depot_lock);
+	for (i=0; i<NSIZES; i++) {
+		kprintf("size %-4lu depot: %u full, %u empty\n",
+			(unsigned long) sizes[i], depots[i].d_nfull,
+			depots[i].d_nempty);
+	}
+	spinlock_release(&depot_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Large-object allocator.
+//
+// Blocks too big for any subpage size get a run of whole pages. The
+// header for a run, struct largeref, is kept off the run, so that an
+// object of exactly a page still takes one page, and is found by
+// hashing the run's address. It records the size asked for, so
+// kfree knows the run without going through the subpage lists and
+// kheap_printfrag can tell what the rounding to pages costs. The
+// first page of each run is tagged KM_TAG_LARGE.
+//
+
+/*
+ * Page tags (kpage_settag). The low bits say what the page holds: 0
+ * for nothing of ours, a subpage size plus one, or KM_TAG_LARGE. The
+ * top bits count live sampled blocks on it for the profiler, sticking
+ * at KM_TAG_SAMPLES once they run out.
+ */
+#define KM_TAG_KIND	0x1f
+#define KM_TAG_LARGE	0x1f
+#define KM_TAG_SAMPLE	0x20
+#define KM_TAG_SAMPLES	0xe0
+
+#define LARGE_BUCKETS	64
+#define LARGE_HASH(addr) (((addr) / PAGE_SIZE) % LARGE_BUCKETS)
+
+struct largeref {
+	vaddr_t lr_addr;
+	unsigned lr_npages;
+	size_t lr_size;
+	struct largeref *lr_next;
+};
+
+static struct spinlock large_spinlock = SPINLOCK_INITIALIZER;
+static struct largeref *largerefs[LARGE_BUCKETS];
+static unsigned large_runs, large_pages;
+static unsigned long large_bytes;
+
+static
+void *
+large_kmalloc(size_t sz)
+{
+	struct largeref *lr;
+	unsigned npages;
+	vaddr_t address;
+
+	lr = kmalloc(sizeof(*lr));
+	if (lr == NULL) {
+		return NULL;
+	}
+	npages = DIVROUNDUP(sz, PAGE_SIZE);
+	address = alloc_kpages(npages);
+	if (address == 0) {
+		kfree(lr);
+		return NULL;
+	}
+	KASSERT(address % PAGE_SIZE == 0);
+	lr->lr_addr = address;
+	lr->lr_npages = npages;
+	lr->lr_size = sz;
+	kpage_settag(address, KM_TAG_LARGE);
+
+	spinlock_acquire(&large_spinlock);
+	lr->lr_next = largerefs[LARGE_HASH(address)];
+	largerefs[LARGE_HASH(address)] = lr;
+	large_runs++;
+	large_pages += npages;
+	large_bytes += sz;
+	spinlock_release(&large_spinlock);
+
+	return (void *)address;
+}
+
+static
+void
+large_kfree(void *ptr)
+{
+	struct largeref **p, *lr;
+	vaddr_t address = (vaddr_t)ptr;
+
+	spinlock_acquire(&large_spinlock);
+	for (p = &largerefs[LARGE_HASH(address)]; (lr = *p) != NULL;
+	     p = &lr->lr_next) {
+		if (lr->lr_addr == address) {
+			break;
+		}
+	}
+	if (lr == NULL) {
+		panic("kfree: large free of invalid addr %p\n", ptr);
+	}
+	*p = lr->lr_next;
+	large_runs--;
+	large_pages -= lr->lr_npages;
+	large_bytes -= lr->lr_size;
+	spinlock_release(&large_spinlock);
+
+	kpage_settag(address, 0);
+	free_kpages(address);
+	kfree(lr);
+}
+
+//
+////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////
+//
+// Sampling profiler.
+//
+// Every kheap_samplerate-th allocation on a cpu is recorded, caller
+// and size, in that cpu's ring (kc_ring), and also entered in a table
+// of live sampled blocks so that kfree can take it out again. To keep
+// kfree from looking in that table for every block, a page's tag
+// counts the live sampled blocks on it and kfree looks only when the
+// count is not zero. kheap_printprofile adds up the rings and the
+// live table by site.
+//
+
+#define KPROF_RATE_DEFAULT	512
+#define KPROF_LIVEMAX		512	/* live sampled blocks tracked */
+#define KPROF_LIVEHASH		128
+#define KPROF_LIVE_HASH(p)	(((p) / 8) % KPROF_LIVEHASH)
+#define KPROF_SITES		128	/* sites in a report */
+#define KPROF_TOP		10
+
+struct kprof_live {
+	vaddr_t kl_ptr;
+	vaddr_t kl_site;
+	size_t kl_size;
+	struct kprof_live *kl_next;
+};
+
+struct kprof_site {
+	vaddr_t ps_site;
+	unsigned ps_count;
+	unsigned long ps_bytes;
+	unsigned ps_live;
+	unsigned long ps_livebytes;
+};
+
+static unsigned kheap_samplerate = KPROF_RATE_DEFAULT;
+
+/* Protects the live table and the page tags' sample counts. */
+static struct spinlock kprof_lock = SPINLOCK_INITIALIZER;
+static struct kprof_live kprof_pool[KPROF_LIVEMAX];
+static struct kprof_live *kprof_free_entries;
+static struct kprof_live *kprof_live[KPROF_LIVEHASH];
+static bool kprof_ready;
+static unsigned kprof_untracked;	/* pool was empty */
+
+/* Built by kheap_printprofile, under kprof_lock. */
+static struct kprof_site kprof_sites[KPROF_SITES];
+
+/*
+ * Is it this cpu's turn to take a sample? Racy, but at worst a
+ * sample is taken early or late.
+ */
+static
+bool
+kprof_due(void)
+{
+	struct kmcache *kc;
+
+	if (kheap_samplerate == 0 || !CURCPU_EXISTS()) {
+		return false;
+	}
+	kc = &curcpu->c_kmcache;
+	if (kc->kc_countdown > 1) {
+		kc->kc_countdown--;
+		return false;
+	}
+	kc->kc_countdown = kheap_samplerate;
+	return true;
+}
+
+static
+void
+kprof_record(void *ptr, size_t sz, vaddr_t site)
+{
+	struct kmcache *kc = &curcpu->c_kmcache;
+	struct kprof_live *kl;
+	vaddr_t addr = (vaddr_t)ptr;
+	unsigned i, tag;
+
+	spinlock_acquire(&kc->kc_lock);
+	kc->kc_ring[kc->kc_nsamples % KPROF_RING].ks_site = site;
+	kc->kc_ring[kc->kc_nsamples % KPROF_RING].ks_size = sz;
+	kc->kc_nsamples++;
+	spinlock_release(&kc->kc_lock);
+
+	spinlock_acquire(&kprof_lock);
+	if (!kprof_ready) {
+		for (i=0; i<KPROF_LIVEMAX; i++) {
+			kprof_pool[i].kl_next = kprof_free_entries;
+			kprof_free_entries = &kprof_pool[i];
+		}
+		kprof_ready = true;
+	}
+	kl = kprof_free_entries;
+	if (kl == NULL) {
+		kprof_untracked++;
+		spinlock_release(&kprof_lock);
+		return;
+	}
+	kprof_free_entries = kl->kl_next;
+	kl->kl_ptr = addr;
+	kl->kl_site = site;
+	kl->kl_size = sz;
+	kl->kl_next = kprof_live[KPROF_LIVE_HASH(addr)];
+	kprof_live[KPROF_LIVE_HASH(addr)] = kl;
+
+	tag = kpage_gettag(addr);
+	if ((tag & KM_TAG_SAMPLES) != KM_TAG_SAMPLES) {
+		kpage_settag(addr, tag + KM_TAG_SAMPLE);
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/*
+ * Drop one live sample from the count in ADDR's page tag. A count
+ * that reached KM_TAG_SAMPLES stays there. Call with kprof_lock held.
+ */
+static
+void
+kprof_untag(vaddr_t addr)
+{
+	unsigned tag;
+
+	tag = kpage_gettag(addr);
+	if ((tag & KM_TAG_SAMPLES) != KM_TAG_SAMPLES) {
+		KASSERT((tag & KM_TAG_SAMPLES) != 0);
+		kpage_settag(addr, tag - KM_TAG_SAMPLE);
+	}
+}
+
+/*
+ * Take a block being freed out of the live table, if it is there.
+ */
+static
+void
+kprof_forget(void *ptr)
+{
+	struct kprof_live **p, *kl;
+	vaddr_t addr = (vaddr_t)ptr;
+
+	spinlock_acquire(&kprof_lock);
+	for (p = &kprof_live[KPROF_LIVE_HASH(addr)]; (kl = *p) != NULL;
+	     p = &kl->kl_next) {
+		if (kl->kl_ptr == addr) {
+			*p = kl->kl_next;
+			kl->kl_next = kprof_free_entries;
+			kprof_free_entries = kl;
+			kprof_untag(addr);
+			break;
+		}
+	}
+	spinlock_release(&kprof_lock);
+}
+
+/* Find or add SITE in kprof_sites. NULL if the table is full. */
+static
+struct kprof_site *
+kprof_site(vaddr_t site)
+{
+	unsigned i, h = (site / 4) % KPROF_SITES;
+
+	for (i=0; i<KPROF_SITES; i++, h = (h + 1) % KPROF_SITES) {
+		if (kprof_sites[h].ps_site == site) {
+			return &kprof_sites[h];
+		}
+		if (kprof_sites[h].ps_site == 0) {
+			kprof_sites[h].ps_site = site;
+			return &kprof_sites[h];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Print the KPROF_TOP sites with the most of WHAT, where WHAT is 0
+ * for bytes, 1 for allocations, 2 for live blocks.
+ */
+static
+void
+kprof_printtop(int what, const char *title)
+{
+	bool shown[KPROF_SITES];
+	unsigned long key, best;
+	unsigned i, n, pick;
+
+	kprintf("%s\n", title);
+	kprintf("  site        allocs      bytes   live  live bytes\n");
+	for (i=0; i<KPROF_SITES; i++) {
+		shown[i] = false;
+	}
+	for (n=0; n<KPROF_TOP; n++) {
+		best = 0;
+		pick = KPROF_SITES;
+		for (i=0; i<KPROF_SITES; i++) {
+			if (shown[i] || kprof_sites[i].ps_site == 0) {
+				continue;
+			}
+			key = what == 0 ? kprof_sites[i].ps_bytes :
+				what == 1 ? kprof_sites[i].ps_count :
+				kprof_sites[i].ps_live;
+			if (key > best) {
+				best = key;
+				pick = i;
+			}
+		}
+		if (pick == KPROF_SITES) {
+			break;
+		}
+		shown[pick] = true;
+		kprintf("  0x%08lx %7u %10lu %6u %11lu\n",
+			(unsigned long)kprof_sites[pick].ps_site,
+			kprof_sites[pick].ps_count, kprof_sites[pick].ps_bytes,
+			kprof_sites[pick].ps_live,
+			kprof_sites[pick].ps_livebytes);
+	}
+}
+
+void
+kheap_printprofile(void)
+{
+	struct kmcache *kc;
+	struct kprof_site *ps;
+	struct kprof_live *kl;
+	unsigned i, n, samples = 0, live = 0;
+
+	spinlock_acquire(&kprof_lock);
+	for (i=0; i<KPROF_SITES; i++) {
+		kprof_sites[i] = (struct kprof_site) { .ps_site = 0 };
+	}
+	for (kc = kmcaches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		n = kc->kc_nsamples < KPROF_RING ? kc->kc_nsamples : KPROF_RING;
+		for (i=0; i<n; i++) {
+			ps = kprof_site(kc->kc_ring[i].ks_site);
+			if (ps != NULL) {
+				ps->ps_count++;
+				ps->ps_bytes += kc->kc_ring[i].ks_size;
+			}
+		}
+		samples += n;
+		spinlock_release(&kc->kc_lock);
+	}
+	for (i=0; i<KPROF_LIVEHASH; i++) {
+		for (kl = kprof_live[i]; kl != NULL; kl = kl->kl_next) {
+			ps = kprof_site(kl->kl_site);
+			if (ps != NULL) {
+				ps->ps_live++;
+				ps->ps_livebytes += kl->kl_size;
+			}
+			live++;
+		}
+	}
+
+	kprintf("kmalloc profile: 1 in %u allocations sampled; "
+		"%u recent samples, %u live (%u not tracked)\n",
+		kheap_samplerate, samples, live, kprof_untracked);
+	kprof_printtop(0, "Top sites by bytes (recent samples):");
+	kprof_printtop(1, "Top sites by allocations (recent samples):");
+	kprof_printtop(2, "Top sites by live blocks (all samples):");
+	spinlock_release(&kprof_lock);
+}
+
+void
+kheap_setsamplerate(unsigned rate)
+{
+	struct kmcache *kc;
+	struct kprof_live *kl;
+	unsigned i;
+
+	for (kc = kmcaches; kc != NULL; kc = kc->kc_next) {
+		spinlock_acquire(&kc->kc_lock);
+		kc->kc_nsamples = 0;
+		kc->kc_countdown = rate;
+		spinlock_release(&kc->kc_lock);
+	}
+	/* empty the live table too, so live counts start from now */
+	spinlock_acquire(&kprof_lock);
+	for (i=0; i<KPROF_LIVEHASH; i++) {
+		while ((kl = kprof_live[i]) != NULL) {
+			kprof_live[i] = kl->kl_next;
+			kl->kl_next = kprof_free_entries;
+			kprof_free_entries = kl;
+			kprof_untag(kl->kl_ptr);
+		}
+	}
+	kprof_untracked = 0;
+	spinlock_release(&kprof_lock);
+	kheap_samplerate = rate;
+}
+
+/*
+ * Count a request in this cpu's size histogram. Racy, but only used
+ * for reporting.
+ */
+static
+void
+kheap_count(size_t sz, size_t given)
+{
+	struct kmcache *kc;
+
+	if (!CURCPU_EXISTS()) {
+		return;
+	}
+	kc = &curcpu->c_kmcache;
+	if (sz > LARGEST_SUBPAGE_SIZE) {
+		kc->kc_hist[KM_HISTBUCKETS - 1]++;
+	}
+	else {
+		kc->kc_hist[sz == 0 ? 0 : (sz - 1) / 8]++;
+	}
+	kc->kc_asked += sz;
+	kc->kc_given += given;
+}
+
+/*
+ * Print how the heap's pages are used: for each subpage size, how
+ * much of its pages is free; what the large runs lose to rounding up
+ * to pages; what rounding up to block sizes costs overall; and the
+ * histogram of sizes asked for since boot.
+ */
+void
+kheap_printfrag(void)
+{
+	unsigned pages[NSIZES], nfree[NSIZES], hist[KM_HISTBUCKETS];
+	unsigned perpage, totpages = 0, col = 0, i;
+	unsigned long freebytes, totfree = 0;
+	uint64_t asked = 0, given = 0;
+	struct pageref *pr;
+	struct kmcache *kc;
+
+	/* blocks in magazines are free for this purpose */
+	kheap_reclaim();
+
+	for (i=0; i<NSIZES; i++) {
+		pages[i] = nfree[i] = 0;
+	}
+	spinlock_acquire(&kmalloc_spinlock);
+	for (pr = allbase; pr != NULL; pr = pr->next_all) {
+		pages[PR_BLOCKTYPE(pr)]++;
+		nfree[PR_BLOCKTYPE(pr)] += pr->nfree;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	kprintf("size   pages  blocks  in use  free bytes\n");
+	for (i=0; i<NSIZES; i++) {
+		if (pages[i] == 0) {
+			continue;
+		}
+		perpage = PAGE_SIZE / sizes[i];
+		/* free blocks, plus the tail of each page no block fits */
+		freebytes = (unsigned long)nfree[i] * sizes[i] +
+			(unsigned long)pages[i] * (PAGE_SIZE - perpage * sizes[i]);
+		kprintf("%4lu %7u %7u %7u %10lu\n", (unsigned long)sizes[i],
+			pages[i], pages[i] * perpage,
+			pages[i] * perpage - nfree[i], freebytes);
+		totpages += pages[i];
+		totfree += freebytes;
+	}
+	kprintf("subpage: %u pages, %lu bytes free in them (%lu%%)\n",
+		totpages, totfree,
+		totpages ? totfree * 100 / ((unsigned long)totpages * PAGE_SIZE) : 0);
+
+	spinlock_acquire(&large_spinlock);
+	kprintf("large: %u runs, %u pages, %lu bytes asked for, "
+		"%lu lost to rounding\n", large_runs, large_pages, large_bytes,
+		(unsigned long)large_pages * PAGE_SIZE - large_bytes);
+	spinlock_release(&large_spinlock);
+
+	for (i=0; i<KM_HISTBUCKETS; i++) {
+		hist[i] = 0;
+	}
+	for (kc = kmcaches; kc != NULL; kc = kc->kc_next) {
+		for (i=0; i<KM_HISTBUCKETS; i++) {
+			hist[i] += kc->kc_hist[i];
+		}
+		asked += kc->kc_asked;
+		given += kc->kc_given;
+	}
+	kprintf("rounding: %llu bytes asked for, %llu given (%llu%% extra)\n",
+		(unsigned long long)asked, (unsigned long long)given,
+		(unsigned long long)(asked ? (given - asked) * 100 / asked : 0));
+
+	kprintf("requests by size:\n");
+	for (i=0; i<KM_HISTBUCKETS; i++) {
+		if (hist[i] == 0) {
+			continue;
+		}
+		if (i == KM_HISTBUCKETS - 1) {
+			kprintf("  large:%8u", hist[i]);
+		}
+		else {
+			kprintf("  <=%-4u:%7u", (i + 1) * 8, hist[i]);
+		}
+		if (++col % 5 == 0) {
+			kprintf("\n");
+		}
+	}
+	if (col % 5 != 0) {
+		kprintf("\n");
+	}
+}
+
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
- * alloc_kpages depending on how big SZ is.
+ * large_kmalloc depending on how big SZ is.
  */
 void *
 kmalloc(size_t sz)
 {
 	size_t checksz;
+	int blktype;
+	void *ptr;
+	vaddr_t site;
 #ifdef LABELS
 	vaddr_t label;
 #endif
 
+	site = (vaddr_t)__builtin_return_address(0);
+
 #ifdef LABELS
 #ifdef __GNUC__
 	label = (vaddr_t)__builtin_return_address(0);
@@ -1231,26 +2104,31 @@ kmalloc(size_t sz)
 #endif /* LABELS */
 
 	checksz = sz + GUARD_OVERHEAD + LABEL_OVERHEAD;
-	if (checksz >= LARGEST_SUBPAGE_SIZE) {
-		unsigned long npages;
-		vaddr_t address;
-
-		/* Round up to a whole number of pages. */
-		npages = (sz + PAGE_SIZE - 1)/PAGE_SIZE;
-		address = alloc_kpages(npages);
-		if (address==0) {
-			return NULL;
-		}
-		KASSERT(address % PAGE_SIZE == 0);
-
-		return (void *)address;
+	if (checksz > LARGEST_SUBPAGE_SIZE) {
+		kheap_count(sz, ROUNDUP(sz, PAGE_SIZE));
+		ptr = large_kmalloc(sz);
 	}
+	else {
+		blktype = blocktype(checksz);
+		kheap_count(sz, sizes[blktype]);
 
+		ptr = NULL;
+#ifdef MAGAZINES
+		ptr = magazine_alloc(blktype);
+#endif
+		if (ptr == NULL) {
 #ifdef LABELS
-	return subpage_kmalloc(sz, label);
+			ptr = subpage_kmalloc(sz, label);
 #else
-	return subpage_kmalloc(sz);
+			ptr = subpage_kmalloc(sz);
 #endif
+		}
+	}
+
+	if (ptr != NULL && kprof_due()) {
+		kprof_record(ptr, sz, site);
+	}
+	return ptr;
 }
 
 /*
@@ -1259,12 +2137,31 @@ kmalloc(size_t sz)
 void
 kfree(void *ptr)
 {
+	unsigned tag;
+
 	/*
-	 * Try subpage first; if that fails, assume it's a big allocation.
+	 * The page's tag says whether it starts a large run or which
+	 * size of subpage block it holds. For anything untagged, try
+	 * subpage first; if that fails, assume it's a big allocation.
 	 */
 	if (ptr == NULL) {
 		return;
-	} else if (subpage_kfree(ptr)) {
+	}
+	tag = kpage_gettag((vaddr_t)ptr);
+	if (tag & KM_TAG_SAMPLES) {
+		kprof_forget(ptr);
+	}
+	tag &= KM_TAG_KIND;
+	if (tag == KM_TAG_LARGE) {
+		large_kfree(ptr);
+		return;
+	}
+#ifdef MAGAZINES
+	if (tag != 0 && magazine_free(tag - 1, ptr)) {
+		return;
+	}
+#endif
+	if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
 		free_kpages((vaddr_t)ptr);
 	}
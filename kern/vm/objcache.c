@@ -0,0 +1,335 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <objcache.h>
+
+/*
+ * Object caches. Each cache carves pages (slabs) into objects of one
+ * size, with a small header at the front of the page, so finding the
+ * slab of an object is a mask. The constructor runs for every object
+ * when a slab is made and the destructor when the slab is given back,
+ * not on each allocation and free, which is what lets hot structures
+ * keep their locks and wait channels from one use to the next.
+ *
+ * Free objects are linked through a word just past the end of each
+ * one, so the free list never disturbs constructed state. A slab is
+ * on oc_partial while some but not all of its objects are in use,
+ * oc_full when all are, and oc_empty when none are. Allocation takes
+ * from partial slabs first, so that empty ones stay empty and can be
+ * reaped when the page allocator runs short.
+ */
+
+#define OC_ALIGN	8
+
+struct ocslab {
+	struct objcache *s_cache;
+	struct ocslab *s_next;
+	struct ocslab *s_prev;
+	void *s_free;			/* free objects */
+	unsigned s_inuse;
+};
+
+#define OC_HEADER	ROUNDUP(sizeof(struct ocslab), OC_ALIGN)
+#define OC_LINK(oc, obj) (*(void **)((char *)(obj) + (oc)->oc_size))
+
+struct objcache {
+	const char *oc_name;
+	size_t oc_size;			/* object size, aligned */
+	size_t oc_stride;		/* object and free list link */
+	unsigned oc_perslab;
+	int (*oc_ctor)(void *obj);
+	void (*oc_dtor)(void *obj);
+
+	struct spinlock oc_lock;
+	struct ocslab *oc_partial;
+	struct ocslab *oc_full;
+	struct ocslab *oc_empty;
+
+	unsigned oc_slabs;
+	unsigned oc_inuse;
+	unsigned oc_allocs;
+	unsigned oc_frees;
+	unsigned oc_grows;
+	unsigned oc_reaped;		/* slabs given back */
+
+	struct objcache *oc_next;	/* all caches */
+};
+
+/* Protects the list of caches. Taken before any oc_lock. */
+static struct spinlock objcache_lock = SPINLOCK_INITIALIZER;
+static struct objcache *objcaches;
+
+static
+void
+slab_push(struct ocslab **list, struct ocslab *slab)
+{
+	slab->s_prev = NULL;
+	slab->s_next = *list;
+	if (*list != NULL) {
+		(*list)->s_prev = slab;
+	}
+	*list = slab;
+}
+
+static
+void
+slab_unlink(struct ocslab **list, struct ocslab *slab)
+{
+	if (slab->s_prev != NULL) {
+		slab->s_prev->s_next = slab->s_next;
+	}
+	else {
+		KASSERT(*list == slab);
+		*list = slab->s_next;
+	}
+	if (slab->s_next != NULL) {
+		slab->s_next->s_prev = slab->s_prev;
+	}
+}
+
+struct objcache *
+objcache_create(const char *name, size_t size,
+		int (*ctor)(void *obj), void (*dtor)(void *obj))
+{
+	struct objcache *oc;
+
+	oc = kmalloc(sizeof(*oc));
+	if (oc == NULL) {
+		return NULL;
+	}
+	oc->oc_name = name;
+	oc->oc_size = ROUNDUP(size, OC_ALIGN);
+	oc->oc_stride = ROUNDUP(oc->oc_size + sizeof(void *), OC_ALIGN);
+	oc->oc_perslab = (PAGE_SIZE - OC_HEADER) / oc->oc_stride;
+	if (oc->oc_perslab == 0) {
+		kfree(oc);
+		return NULL;
+	}
+	oc->oc_ctor = ctor;
+	oc->oc_dtor = dtor;
+
+	spinlock_init(&oc->oc_lock);
+	oc->oc_partial = oc->oc_full = oc->oc_empty = NULL;
+	oc->oc_slabs = oc->oc_inuse = 0;
+	oc->oc_allocs = oc->oc_frees = 0;
+	oc->oc_grows = oc->oc_reaped = 0;
+
+	spinlock_acquire(&objcache_lock);
+	oc->oc_next = objcaches;
+	objcaches = oc;
+	spinlock_release(&objcache_lock);
+
+	return oc;
+}
+
+/*
+ * Destroy the objects on a slab's free list and free its page.
+ */
+static
+void
+slab_destroy(struct objcache *oc, struct ocslab *slab)
+{
+	void *obj, *next;
+
+	for (obj = slab->s_free; obj != NULL; obj = next) {
+		next = OC_LINK(oc, obj);
+		if (oc->oc_dtor != NULL) {
+			oc->oc_dtor(obj);
+		}
+	}
+	free_kpages((vaddr_t)slab);
+}
+
+/*
+ * Make a new slab of constructed objects. Called without oc_lock, as
+ * both the page allocator and the constructor may need to allocate.
+ */
+static
+struct ocslab *
+slab_create(struct objcache *oc)
+{
+	struct ocslab *slab;
+	vaddr_t page, obj;
+	unsigned i;
+
+	page = alloc_kpages(1);
+	if (page == 0) {
+		return NULL;
+	}
+	slab = (struct ocslab *)page;
+	slab->s_cache = oc;
+	slab->s_free = NULL;
+	slab->s_inuse = 0;
+
+	obj = page + OC_HEADER;
+	for (i=0; i<oc->oc_perslab; i++, obj += oc->oc_stride) {
+		if (oc->oc_ctor != NULL && oc->oc_ctor((void *)obj)) {
+			/* the free list holds just the ones already made */
+			slab_destroy(oc, slab);
+			return NULL;
+		}
+		OC_LINK(oc, obj) = slab->s_free;
+		slab->s_free = (void *)obj;
+	}
+	return slab;
+}
+
+void
+objcache_destroy(struct objcache *oc)
+{
+	struct objcache **p;
+	struct ocslab *slab;
+
+	KASSERT(oc->oc_inuse == 0);
+	KASSERT(oc->oc_partial == NULL && oc->oc_full == NULL);
+
+	spinlock_acquire(&objcache_lock);
+	for (p = &objcaches; *p != oc; p = &(*p)->oc_next) {
+		KASSERT(*p != NULL);
+	}
+	*p = oc->oc_next;
+	spinlock_release(&objcache_lock);
+
+	while ((slab = oc->oc_empty) != NULL) {
+		slab_unlink(&oc->oc_empty, slab);
+		slab_destroy(oc, slab);
+	}
+	spinlock_cleanup(&oc->oc_lock);
+	kfree(oc);
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct ocslab *slab, **list;
+	void *obj;
+
+	spinlock_acquire(&oc->oc_lock);
+	while (oc->oc_partial == NULL && oc->oc_empty == NULL) {
+		spinlock_release(&oc->oc_lock);
+		slab = slab_create(oc);
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		slab_push(&oc->oc_empty, slab);
+		oc->oc_slabs++;
+		oc->oc_grows++;
+	}
+	list = oc->oc_partial != NULL ? &oc->oc_partial : &oc->oc_empty;
+	slab = *list;
+	slab_unlink(list, slab);
+
+	obj = slab->s_free;
+	slab->s_free = OC_LINK(oc, obj);
+	slab->s_inuse++;
+	slab_push(slab->s_free != NULL ? &oc->oc_partial : &oc->oc_full, slab);
+
+	oc->oc_inuse++;
+	oc->oc_allocs++;
+	spinlock_release(&oc->oc_lock);
+	return obj;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct ocslab *slab;
+
+	slab = (struct ocslab *)((vaddr_t)obj & PAGE_FRAME);
+	if (slab->s_cache != oc ||
+	    ((vaddr_t)obj - (vaddr_t)slab - OC_HEADER) % oc->oc_stride != 0) {
+		panic("objcache_free: %p is not from %s\n", obj, oc->oc_name);
+	}
+
+	spinlock_acquire(&oc->oc_lock);
+	KASSERT(slab->s_inuse > 0);
+	slab_unlink(slab->s_free != NULL ? &oc->oc_partial : &oc->oc_full, slab);
+	OC_LINK(oc, obj) = slab->s_free;
+	slab->s_free = obj;
+	slab->s_inuse--;
+	slab_push(slab->s_inuse > 0 ? &oc->oc_partial : &oc->oc_empty, slab);
+
+	oc->oc_inuse--;
+	oc->oc_frees++;
+	spinlock_release(&oc->oc_lock);
+}
+
+/*
+ * Called by the page allocator when it runs out of pages, and before
+ * the heap is measured. Destructors run with no locks held, as they
+ * may free to other caches, or even land back here.
+ */
+void
+objcache_reap(void)
+{
+	struct objcache *oc;
+	struct ocslab *list = NULL, *slab;
+
+	spinlock_acquire(&objcache_lock);
+	for (oc = objcaches; oc != NULL; oc = oc->oc_next) {
+		spinlock_acquire(&oc->oc_lock);
+		while ((slab = oc->oc_empty) != NULL) {
+			slab_unlink(&oc->oc_empty, slab);
+			slab->s_next = list;
+			list = slab;
+			oc->oc_slabs--;
+			oc->oc_reaped++;
+		}
+		spinlock_release(&oc->oc_lock);
+	}
+	spinlock_release(&objcache_lock);
+
+	while ((slab = list) != NULL) {
+		list = slab->s_next;
+		slab_destroy(slab->s_cache, slab);
+	}
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+
+	kprintf("cache            size  /slab  slabs   inuse   allocs    frees"
+		"  grows  reaped\n");
+	spinlock_acquire(&objcache_lock);
+	for (oc = objcaches; oc != NULL; oc = oc->oc_next) {
+		kprintf("%-14s %6lu %6u %6u %7u %8u %8u %6u %7u\n",
+			oc->oc_name, (unsigned long)oc->oc_size,
+			oc->oc_perslab, oc->oc_slabs, oc->oc_inuse,
+			oc->oc_allocs, oc->oc_frees, oc->oc_grows,
+			oc->oc_reaped);
+	}
+	spinlock_release(&objcache_lock);
+}
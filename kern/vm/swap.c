@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <synch.h>
+#include <uio.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <vm.h>
+
+/*
+ * Swap space: one page-sized slot per PAGE_SIZE of the swap disk, with
+ * a bitmap of slots in use. Everything here is serialized by swap_lock,
+ * which the pager holds for the whole of an eviction or page-in.
+ */
+
+static struct vnode *swap_vnode;
+static struct bitmap *swap_map;
+static unsigned int swap_slots;
+static struct lock *swap_lock;
+
+void swap_bootstrap(void)
+{
+	struct stat st;
+
+	if (vfs_swapon(SWAP_DEVICE, &swap_vnode)) {
+		kprintf("swap: no %s, paging disabled\n", SWAP_DEVICE);
+		swap_vnode = NULL;
+		return;
+	}
+	if (VOP_STAT(swap_vnode, &st) || st.st_size < PAGE_SIZE) {
+		panic("swap: cannot size %s\n", SWAP_DEVICE);
+	}
+	swap_slots = st.st_size / PAGE_SIZE;
+	swap_map = bitmap_create(swap_slots);
+	swap_lock = lock_create("swap");
+	if (swap_map == NULL || swap_lock == NULL) {
+		panic("swap: out of memory\n");
+	}
+	kprintf("swap: %u pages on %s\n", swap_slots, SWAP_DEVICE);
+}
+
+bool swap_enabled(void)
+{
+	return swap_lock != NULL;
+}
+
+void swap_acquire(void)
+{
+	lock_acquire(swap_lock);
+}
+
+void swap_release(void)
+{
+	lock_release(swap_lock);
+}
+
+bool swap_holding(void)
+{
+	return swap_lock != NULL && lock_do_i_hold(swap_lock);
+}
+
+int swap_alloc(unsigned int *slot)
+{
+	return bitmap_alloc(swap_map, slot);
+}
+
+void swap_free(unsigned int slot)
+{
+	KASSERT(slot < swap_slots);
+	bitmap_unmark(swap_map, slot);
+}
+
+static int swap_io(unsigned int slot, paddr_t paddr, enum uio_rw rw)
+{
+	struct iovec iov;
+	struct uio u;
+
+	KASSERT(lock_do_i_hold(swap_lock));
+	KASSERT(slot < swap_slots);
+
+	uio_kinit(&iov, &u, (void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  (off_t) slot * PAGE_SIZE, rw);
+	if (rw == UIO_READ)
+		return VOP_READ(swap_vnode, &u);
+	return VOP_WRITE(swap_vnode, &u);
+}
+
+int swap_read(unsigned int slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_READ);
+}
+
+int swap_write(unsigned int slot, paddr_t paddr)
+{
+	return swap_io(slot, paddr, UIO_WRITE);
+}
@@ -10,101 +10,1909 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <elf.h>
+#include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <uio.h>
+#include <vnode.h>
+#include <clock.h>
+#include <objcache.h>
 
-static uint32_t tlb_index = 0;
-static struct spinlock tlb_lock;
+static uint32_t tlb_next_tag = 1;	/* 0 means no address space */
+static struct spinlock tlb_lock = SPINLOCK_INITIALIZER;	/* protects tlb_next_tag */
+static struct tlbstate *tlbstates;
 static struct cm_listing *coremap;
 static unsigned int coremap_start;
 static unsigned int coremap_count;
 static volatile unsigned int free_places;
 static struct spinlock coremap_lock;
+static unsigned int clock_hand;
+
+unsigned int vm_faultaround = FAULTAROUND_DEFAULT;
+unsigned int vm_prefault = PREFAULT_DEFAULT;
+bool vm_superpages = true;
+static unsigned int fault_count, faultaround_mapped, prefault_mapped;
+static unsigned int superpage_mapped, superpage_fallbacks;
+static unsigned int run_reclaims, run_reclaim_pages, run_reclaim_failures;
+
+volatile enum vm_pressure vm_pressure = VM_PRESSURE_NONE;
+static unsigned int pressure_low, pressure_high;	/* watermarks, pages */
+static unsigned int pressure_events, oom_kills;
+
+/* Read-only file pages by (vnode, offset); protected by coremap_lock. */
+static unsigned int filecache[FILECACHE_BUCKETS];
+static unsigned int filecache_count, filecache_hits, filecache_misses;
+
+/* Pre-zeroed free pages, linked through next_free; see zeroer_thread(). */
+static struct spinlock zero_lock = SPINLOCK_INITIALIZER;
+static unsigned int zero_pool = CM_NONE;
+static volatile unsigned int zero_count;
+static struct wchan *zero_wchan;
+static unsigned int zero_hits, zero_misses, zero_cleared;
+
+static unsigned int zeropool_get(void);
+static void zeropool_reclaim(void);
+static void zeroer_thread(void *data1, unsigned long data2);
+static void cm_free_run(unsigned int index, unsigned int npages);
+static void filecache_remove(unsigned int index);
+static paddr_t allocate_user_block(struct addrspace *as, vaddr_t vaddr);
+static int filecache_map(pte_t *pte, struct addrspace *as,
+			 struct region *r, vaddr_t vaddr);
+
+/* Held for the whole of a compaction; see vm_compact(). */
+static struct lock *migrate_lock;
+static unsigned int compact_runs, compact_failures, pages_migrated;
+
+/* Remote TLB invalidations in flight; see vm_tlbshootdown_range(). */
+static struct lock *shootdown_lock;
+static struct spinlock shootdown_spinlock;
+static struct wchan *shootdown_wchan;
+static unsigned int shootdown_pending;
 
 
 void vm_bootstrap(void)
 {
-	spinlock_init(&tlb_lock);
+	spinlock_init(&shootdown_spinlock);
+	shootdown_lock = lock_create("shootdown");
+	shootdown_wchan = wchan_create("shootdown");
+	migrate_lock = lock_create("migrate");
+	region_cache = objcache_create("region", sizeof(struct region),
+				       NULL, NULL);
+	if (shootdown_lock == NULL || shootdown_wchan == NULL ||
+	    migrate_lock == NULL || region_cache == NULL)
+		panic("vm_bootstrap: out of memory\n");
+	swap_bootstrap();
+
+	zero_wchan = wchan_create("zeroer");
+	if (zero_wchan == NULL)
+		panic("vm_bootstrap: out of memory\n");
+	int result = thread_fork("zeroer", NULL, zeroer_thread, NULL, 0);
+	if (result)
+		panic("vm_bootstrap: thread_fork zeroer: %s\n", strerror(result));
+}
+
+/*
+ * Mark every slot of this CPU's TLB invalid. Interrupts must be off.
+ */
+static void tlb_flush(struct tlbstate *ts)
+{
+	for (int i = 0; i < NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		ts->ts_free[i] = NUM_TLB - 1 - i;
+	}
+	ts->ts_nfree = NUM_TLB;
+	ts->ts_flushes++;
+}
+
+/*
+ * Enter a translation in the TLB, replacing any existing entry for
+ * the same page (there may be a read-only one if we are upgrading a
+ * copy-on-write page). Otherwise use an invalid slot if there is one
+ * and evict round-robin if not.
+ */
+static void tlb_load(vaddr_t vaddr, paddr_t paddr, bool writable)
+{
+	uint32_t ehi, elo;
+	int spl, i;
+
+	ehi = vaddr;
+	elo = paddr | TLBLO_VALID;
+	if (writable)
+		elo |= TLBLO_DIRTY;
+
+	spl = splhigh();
+	struct tlbstate *ts = &curcpu->c_tlb;
+	i = tlb_probe(ehi, 0);
+	if (i < 0) {
+		if (ts->ts_nfree > 0) {
+			i = ts->ts_free[--ts->ts_nfree];
+		} else {
+			i = ts->ts_victim;
+			ts->ts_victim = (ts->ts_victim + 1) % NUM_TLB;
+		}
+	}
+	tlb_write(ehi, elo, i);
+	ts->ts_refills++;
+	splx(spl);
+}
+
+/*
+ * Like tlb_load, but only into a free slot and only if the page is not
+ * in the TLB already. Returns 1 if it was entered, 0 if it was there,
+ * -1 if there are no free slots left.
+ */
+static int tlb_prefetch(vaddr_t vaddr, paddr_t paddr, bool writable)
+{
+	uint32_t elo = paddr | TLBLO_VALID;
+	int result = 0;
+
+	if (writable)
+		elo |= TLBLO_DIRTY;
+
+	int spl = splhigh();
+	struct tlbstate *ts = &curcpu->c_tlb;
+	if (ts->ts_nfree == 0) {
+		result = -1;
+	} else if (tlb_probe(vaddr, 0) < 0) {
+		tlb_write(vaddr, elo, ts->ts_free[--ts->ts_nfree]);
+		ts->ts_refills++;
+		result = 1;
+	}
+	splx(spl);
+	return result;
+}
+
+static void cm_setup(unsigned int index, unsigned int npages, int type)
+{
+	for (unsigned int i = index; i < index + npages; i++) {
+		if(type == 0) //kernel page
+			coremap[i].state = FIXED;
+		else
+			coremap[i].state = DIRTY;
+		coremap[i].page_count = 0;
+		coremap[i].order = CM_NOORDER;
+		coremap[i].as = NULL;
+		coremap[i].sharers = NULL;
+		coremap[i].swap_slot = CM_NONE;
+		coremap[i].busy = false;
+		coremap[i].fc_vnode = NULL;
+		coremap[i].km_tag = 0;
+	}
+	coremap[index].page_count = npages;
+	coremap[index].refcount = 1;
+}
+
+/*
+ * Add a mapping of the frame at index by as at vaddr, using sh, and
+ * take a reference for it. Needs coremap_lock.
+ */
+static void rmap_add(unsigned int index, struct addrspace *as, vaddr_t vaddr,
+		     struct cm_sharer *sh)
+{
+	struct cm_listing *cm = &coremap[index];
+
+	KASSERT(cm->as != NULL && cm->refcount > 0);
+	sh->sh_as = as;
+	sh->sh_vaddr = vaddr;
+	sh->sh_next = cm->sharers;
+	cm->sharers = sh;
+	cm->refcount++;
+}
+
+/*
+ * Remove the mapping of the frame at index by as at vaddr; the caller
+ * drops the reference. Needs coremap_lock. Returns a list node for
+ * the caller to kfree once the lock is released, or NULL.
+ */
+static struct cm_sharer *rmap_remove(unsigned int index,
+				     struct addrspace *as, vaddr_t vaddr)
+{
+	struct cm_listing *cm = &coremap[index];
+	struct cm_sharer *sh, **link;
+
+	if (cm->as == as && cm->vaddr == vaddr) {
+		sh = cm->sharers;
+		if (sh == NULL) {
+			cm->as = NULL;
+			return NULL;
+		}
+		cm->as = sh->sh_as;
+		cm->vaddr = sh->sh_vaddr;
+		cm->sharers = sh->sh_next;
+		return sh;
+	}
+	for (link = &cm->sharers; *link != NULL; link = &(*link)->sh_next) {
+		sh = *link;
+		if (sh->sh_as == as && sh->sh_vaddr == vaddr) {
+			*link = sh->sh_next;
+			return sh;
+		}
+	}
+	panic("vm: frame %u has no mapping at %p 0x%x\n", index, as, vaddr);
+}
+
+/* Unmap paddr from as at vaddr and drop that reference. */
+static void page_unmap(paddr_t paddr, struct addrspace *as, vaddr_t vaddr)
+{
+	spinlock_acquire(&coremap_lock);
+	struct cm_sharer *sh = rmap_remove(paddr / PAGE_SIZE - coremap_start,
+					   as, vaddr);
+	spinlock_release(&coremap_lock);
+	if (sh != NULL)
+		kfree(sh);
+	page_decref(paddr);
+}
+
+/*
+ * Make pte map a frame from allocate_user_page() and let the pager at
+ * it. slot is the swap slot the contents came from, if any.
+ */
+static void pte_install(pte_t *pte, paddr_t paddr, unsigned int slot)
+{
+	unsigned int index = paddr / PAGE_SIZE - coremap_start;
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[index].busy);
+	struct addrspace *as = coremap[index].as;
+	if (!(*pte & PTE_VALID))
+		as->rss++;
+	if (*pte & PTE_SWAPPED)
+		as->swapped--;
+	*pte = paddr | PTE_VALID | PTE_REFERENCED | (*pte & PTE_MODIFIED);
+	if (slot == CM_NONE)
+		*pte |= PTE_DIRTY;
+	coremap[index].state = slot == CM_NONE ? DIRTY : CLEAN;
+	coremap[index].swap_slot = slot;
+	coremap[index].busy = false;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Fill a fresh frame for vaddr from the file behind an mmap region.
+ * Anything past the end of the file stays zero.
+ */
+static int page_read_file(struct region *r, vaddr_t vaddr, paddr_t paddr)
+{
+	struct iovec iov;
+	struct uio u;
+
+	uio_kinit(&iov, &u, (void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE,
+		  r->reg_offset + (vaddr - r->reg_start), UIO_READ);
+	return VOP_READ(r->reg_vnode, &u);
+}
+
+/*
+ * Read a swapped-out page into a fresh frame for (as, vaddr). The
+ * page keeps its slot so it can be evicted again without a write.
+ */
+static int page_in(pte_t *pte, struct addrspace *as, vaddr_t vaddr)
+{
+	paddr_t paddr = allocate_user_page(as, vaddr, PAGE_NOZERO);
+	if (paddr == 0)
+		return ENOMEM;
+
+	swap_acquire();
+	KASSERT(*pte & PTE_SWAPPED);
+	unsigned int slot = PTE_SLOT(*pte);
+	int result = swap_read(slot, paddr);
+	swap_release();
+	if (result)
+		panic("vm: swap read of slot %u failed: %s\n", slot, strerror(result));
+
+	pte_install(pte, paddr, slot);
+	return 0;
+}
+
+/*
+ * First write to a copy-on-write page: if other address spaces still
+ * share the frame, give this one a private copy; otherwise just take
+ * the frame back as writable.
+ */
+static int cow_break(pte_t *pte, struct addrspace *as, vaddr_t vaddr)
+{
+	/* other CPUs may hold the read-only entry */
+	vm_tlbretag(as);
+
+	spinlock_acquire(&coremap_lock);
+	paddr_t old = *pte & PTE_FRAME;
+	unsigned int index = old / PAGE_SIZE - coremap_start;
+	if (coremap[index].refcount == 1) {
+		if (coremap[index].fc_vnode != NULL)
+			filecache_remove(index);
+		*pte &= ~PTE_READONLY;
+		KASSERT(coremap[index].as == as && coremap[index].vaddr == vaddr);
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	spinlock_release(&coremap_lock);
+
+	/* shared frames are never evicted, and we hold a reference */
+	paddr_t new = allocate_user_page(as, vaddr, PAGE_NOZERO);
+	if (new == 0)
+		return ENOMEM;
+	memmove((void *) PADDR_TO_KVADDR(new),
+			(const void *) PADDR_TO_KVADDR(old), PAGE_SIZE);
+	pte_install(pte, new, CM_NONE);
+	page_unmap(old, as, vaddr);
+	return 0;
+}
+
+/*
+ * Pages of a shared, writable file mapping are written back to the
+ * file only if they have been written (PTE_MODIFIED), so their TLB
+ * entries are loaded writable only once that is so; the first write
+ * after a read then faults and sets the bit.
+ */
+static bool region_tracks_writes(struct region *region)
+{
+	return region->reg_type == REGION_MMAP && region->reg_vnode != NULL &&
+		region->reg_shared;
+}
+
+/*
+ * Whether a TLB entry for a resident page may be loaded writable.
+ */
+static bool pte_writeable(struct region *region, pte_t entry, bool writeable)
+{
+	if (!writeable || (entry & (PTE_READONLY | PTE_DIRTY)) != PTE_DIRTY)
+		return false;
+	return !region_tracks_writes(region) || (entry & PTE_MODIFIED);
+}
+
+/*
+ * Enter resident neighbours of vaddr in region into free TLB slots,
+ * nearest first, so that walking through them does not trap. Called
+ * with coremap_lock held.
+ */
+static void fault_around(struct addrspace *as, struct region *region,
+			 vaddr_t vaddr, bool writeable)
+{
+	unsigned int mapped = 0;
+
+	KASSERT(spinlock_do_i_hold(&coremap_lock));
+	for (unsigned int d = 1; d <= vm_faultaround && mapped < vm_faultaround; d++) {
+		for (int side = 0; side < 2; side++) {
+			vaddr_t va = side == 0 ? vaddr + d * PAGE_SIZE : vaddr - d * PAGE_SIZE;
+			if (va < region->reg_start || va >= region->reg_end)
+				continue;
+			pte_t *pte = find_pte(as->first, va);
+			if (pte == NULL || !(*pte & PTE_VALID))
+				continue;
+			int result = tlb_prefetch(va, *pte & PTE_FRAME,
+				pte_writeable(region, *pte, writeable));
+			if (result < 0)
+				goto done;
+			mapped += result;
+		}
+	}
+done:
+	faultaround_mapped += mapped;
+}
+
+/*
+ * First touch of an anonymous page. If it follows closely on the last
+ * one in either direction, the program is probably walking through
+ * memory, so allocate the next few pages the same way now.
+ */
+static void prefault(struct addrspace *as, struct region *region,
+		     vaddr_t vaddr)
+{
+	vaddr_t last = as->last_fault;
+	vaddr_t reach = (vm_faultaround + vm_prefault + 1) * PAGE_SIZE;
+	bool up;
+
+	as->last_fault = vaddr;
+	if (vm_prefault == 0 || vm_pressure != VM_PRESSURE_NONE ||
+	    region->reg_vnode != NULL ||
+	    region->reg_type == REGION_SEGMENT)
+		return;
+	if (vaddr > last && vaddr - last <= reach)
+		up = true;
+	else if (vaddr < last && last - vaddr <= reach)
+		up = false;
+	else
+		return;
+
+	for (unsigned int k = 1; k <= vm_prefault; k++) {
+		vaddr_t va = up ? vaddr + k * PAGE_SIZE : vaddr - k * PAGE_SIZE;
+		if (va < region->reg_start || va >= region->reg_end)
+			break;
+		if (coremap_free_pages() < PREFAULT_MIN_FREE)
+			break;
+		pte_t *pte = alloc_pte(as, va);
+		if (pte == NULL)
+			break;
+		if (*pte != 0)
+			continue;
+		paddr_t paddr = allocate_user_page(as, va, 0);
+		if (paddr == 0)
+			break;
+		pte_install(pte, paddr, CM_NONE);
+		spinlock_acquire(&coremap_lock);
+		if (*pte & PTE_VALID)
+			tlb_prefetch(va, *pte & PTE_FRAME,
+				     (region->reg_perms & REG_WRITE) != 0);
+		spinlock_release(&coremap_lock);
+		prefault_mapped++;
+	}
+}
+
+/*
+ * Map the whole aligned superpage around vaddr if it lies inside an
+ * anonymous writable region and none of it is mapped yet. Returns
+ * false if it could not, and the caller maps a single page instead.
+ */
+static bool superpage_map(struct addrspace *as, struct region *region,
+			  vaddr_t vaddr)
+{
+	vaddr_t base = vaddr & ~(vaddr_t)(SUPERPAGE_SIZE - 1);
+
+	if (!vm_superpages || vm_pressure != VM_PRESSURE_NONE ||
+	    as->loading || region->reg_vnode != NULL ||
+	    !(region->reg_perms & REG_WRITE) ||
+	    region->reg_type == REGION_SEGMENT ||
+	    base < region->reg_start || base + SUPERPAGE_SIZE > region->reg_end)
+		return false;
+	if (coremap_free_pages() < SUPERPAGE_MIN_FREE)
+		return false;
+
+	/* a superpage never crosses a second-level table */
+	pte_t *ptes = alloc_pte(as, base);
+	if (ptes == NULL)
+		return false;
+	for (unsigned int i = 0; i < SUPERPAGE_PAGES; i++) {
+		if (ptes[i] != 0)
+			return false;
+	}
+
+	paddr_t paddr = allocate_user_block(as, base);
+	if (paddr == 0) {
+		superpage_fallbacks++;
+		return false;
+	}
+	for (unsigned int i = 0; i < SUPERPAGE_PAGES; i++)
+		pte_install(&ptes[i], paddr + i * PAGE_SIZE, CM_NONE);
+	superpage_mapped++;
+	return true;
+}
+
+void vm_faultstats(void)
+{
+	kprintf("fault-around %u, prefault %u: %u faults, %u pages mapped "
+		"around, %u pages prefaulted\n", vm_faultaround, vm_prefault,
+		fault_count, faultaround_mapped, prefault_mapped);
+	kprintf("superpages %s: %u mapped (%u pages), %u fell back to "
+		"single pages\n", vm_superpages ? "on" : "off",
+		superpage_mapped, superpage_mapped * SUPERPAGE_PAGES,
+		superpage_fallbacks);
+	kprintf("contiguous runs: %u cleared by paging out %u pages, "
+		"%u failed\n", run_reclaims, run_reclaim_pages,
+		run_reclaim_failures);
+}
+
+void vm_faultstats_reset(void)
+{
+	fault_count = faultaround_mapped = prefault_mapped = 0;
+	superpage_mapped = superpage_fallbacks = 0;
+	run_reclaims = run_reclaim_pages = run_reclaim_failures = 0;
+}
+
+static void vm_pressure_update(void)
+{
+	unsigned int free = coremap_free_pages();
+
+	if (free < pressure_low && vm_pressure == VM_PRESSURE_NONE) {
+		vm_pressure = VM_PRESSURE_LOW;
+		pressure_events++;
+	} else if (free >= pressure_high && vm_pressure != VM_PRESSURE_NONE) {
+		vm_pressure = VM_PRESSURE_NONE;
+	}
+}
+
+/*
+ * A fault could not get a page even by paging out. Kill the process
+ * using the most memory, unless an earlier victim has yet to go, and
+ * give it time to exit. Returns 0 if the fault should be retried, or
+ * ENOMEM if the faulting process is itself the one to go.
+ */
+static int vm_oom(void)
+{
+	bool pending;
+
+	vm_pressure = VM_PRESSURE_CRITICAL;
+	if (curproc->p_killed)
+		return ENOMEM;
+
+	struct proc *victim = proc_oomselect(&pending);
+	if (victim == NULL && !pending) {
+		/* nobody else to blame */
+		victim = curproc;
+		victim->p_killed = true;
+	}
+	if (victim != NULL) {
+		oom_kills++;
+		kprintf("vm: out of memory, killing pid %d (%s)\n",
+			victim->p_pid, victim->p_name);
+		vm_printmem();
+		if (victim == curproc)
+			return ENOMEM;
+	}
+	clocksleep(1);
+	return 0;
+}
+
+static const char *const pressure_names[] = { "none", "low", "critical" };
+
+void vm_printmem(void)
+{
+	vm_pressure_update();
+	kprintf("memory: %u of %u pages free, pressure %s (low mark %u, "
+		"high mark %u), %u times low, %u OOM kills\n",
+		coremap_free_pages(), coremap_count, pressure_names[vm_pressure],
+		pressure_low, pressure_high, pressure_events, oom_kills);
+	proc_printmem();
+}
+
+#define DUMP_SHARERS	4
+
+static const char *cm_kind(const struct cm_listing *cm)
+{
+	if (cm->state == FREE)
+		return "free";
+	if (cm->state == FIXED)
+		return "kernel";
+	return "user";
+}
+
+/*
+ * Print count coremap entries from first: who maps each user frame,
+ * and runs of free, kernel or not-yet-mapped frames as one line each.
+ * Each entry is copied under coremap_lock and printed after.
+ */
+void vm_dumpcoremap(unsigned int first, unsigned int count)
+{
+	struct cm_sharer sharers[DUMP_SHARERS];
+	struct cm_listing cm;
+	unsigned int i, end, run, nsharers, more;
+
+	if (first >= coremap_count)
+		return;
+	if (count > coremap_count - first)
+		count = coremap_count - first;
+	end = first + count;
+
+	for (i = first; i < end; i += run) {
+		run = 1;
+		nsharers = more = 0;
+		spinlock_acquire(&coremap_lock);
+		cm = coremap[i];
+		if (cm.as == NULL) {
+			while (i + run < end && coremap[i + run].as == NULL &&
+			       cm_kind(&coremap[i + run]) == cm_kind(&cm))
+				run++;
+		}
+		for (struct cm_sharer *sh = cm.sharers; sh != NULL; sh = sh->sh_next) {
+			if (nsharers < DUMP_SHARERS)
+				sharers[nsharers++] = *sh;
+			else
+				more++;
+		}
+		spinlock_release(&coremap_lock);
+
+		paddr_t paddr = (coremap_start + i) * PAGE_SIZE;
+		if (cm.as == NULL) {
+			kprintf("0x%08x-0x%08x %-6s %u page%s\n", paddr,
+				paddr + run * PAGE_SIZE - 1, cm_kind(&cm), run,
+				run == 1 ? "" : "s");
+			continue;
+		}
+		kprintf("0x%08x %s ref %u %s%s as %p va 0x%08x", paddr,
+			cm.state == DIRTY ? "dirty" : "clean", cm.refcount,
+			cm.busy ? "busy " : "", cm.fc_vnode != NULL ? "file " : "",
+			cm.as, cm.vaddr);
+		for (unsigned int k = 0; k < nsharers; k++)
+			kprintf(", as %p va 0x%08x", sharers[k].sh_as,
+				sharers[k].sh_vaddr);
+		if (more > 0)
+			kprintf(", %u more", more);
+		kprintf("\n");
+	}
+}
+
+int vm_fault(int faulttype, vaddr_t faultaddress)
+{
+
+	if (curproc == NULL) 
+		return EFAULT;
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) 
+		return EFAULT;
+
+	if (faulttype != VM_FAULT_READONLY)
+		curcpu->c_tlb.ts_misses++;
+	fault_count++;
+
+	faultaddress &= PAGE_FRAME;
+	struct region *region = as_find_region(as, faultaddress);
+	if (region == NULL || region->reg_perms == 0) 
+		return EFAULT;
+	bool writeable = (region->reg_perms & REG_WRITE) || as->loading;
+	if (faulttype != VM_FAULT_READ && !writeable)
+		return EFAULT;
+
+	pte_t *pte = alloc_pte(as, faultaddress);
+	if (pte == NULL)
+		return ENOMEM;
+
+	/*
+	 * The pager may take the page away whenever coremap_lock is not
+	 * held, so check the entry and load the TLB under the lock and
+	 * start over after anything that sleeps.
+	 */
+	int result;
+	bool fresh = false;
+	unsigned int oom_tries = 0;
+	while (1) {
+		spinlock_acquire(&coremap_lock);
+		pte_t entry = *pte;
+		if (entry & PTE_VALID) {
+			paddr_t paddr = entry & PTE_FRAME;
+			if (faulttype == VM_FAULT_READONLY &&
+			    (entry & (PTE_READONLY | PTE_DIRTY)) == PTE_DIRTY &&
+			    (!region_tracks_writes(region) || (entry & PTE_MODIFIED))) {
+				spinlock_release(&coremap_lock);
+				return EFAULT;
+			}
+			if (faulttype != VM_FAULT_READ && (entry & PTE_READONLY)) {
+				spinlock_release(&coremap_lock);
+				result = cow_break(pte, as, faultaddress);
+				if (result == ENOMEM && oom_tries++ < OOM_RETRIES)
+					result = vm_oom();
+				if (result)
+					return result;
+				continue;
+			}
+			if (faulttype != VM_FAULT_READ && !(entry & PTE_DIRTY)) {
+				entry |= PTE_DIRTY;
+				coremap[paddr / PAGE_SIZE - coremap_start].state = DIRTY;
+			}
+			if (faulttype != VM_FAULT_READ && region_tracks_writes(region))
+				entry |= PTE_MODIFIED;
+			*pte = entry | PTE_REFERENCED;
+			tlb_load(faultaddress, paddr,
+				 pte_writeable(region, entry, writeable));
+			if (!as->loading)
+				fault_around(as, region, faultaddress, writeable);
+			spinlock_release(&coremap_lock);
+			if (fresh)
+				prefault(as, region, faultaddress);
+			return 0;
+		}
+		bool swapped = (entry & PTE_SWAPPED) != 0;
+		bool migrating = (entry & PTE_MIGRATING) != 0;
+		spinlock_release(&coremap_lock);
+
+		if (migrating) {
+			vm_pager_barrier();
+			continue;
+		}
+		if (swapped) {
+			result = page_in(pte, as, faultaddress);
+		} else if (region->reg_vnode != NULL &&
+			   !(region->reg_perms & REG_WRITE)) {
+			result = filecache_map(pte, as, region, faultaddress);
+		} else if (superpage_map(as, region, faultaddress)) {
+			result = 0;
+		} else {
+			paddr_t paddr = allocate_user_page(as, faultaddress, 0);
+			result = paddr == 0 ? ENOMEM : 0;
+			if (paddr != 0 && region->reg_vnode != NULL)
+				result = page_read_file(region, faultaddress, paddr);
+			if (paddr != 0 && result)
+				page_decref(paddr);
+			else if (paddr != 0)
+				pte_install(pte, paddr, CM_NONE);
+			fresh = true;
+		}
+		if (result == ENOMEM && oom_tries++ < OOM_RETRIES)
+			result = vm_oom();
+		if (result)
+			return result;
+	}
+}
+
+/*
+ * Give the child of a fork its view of one page. Resident frames are
+ * shared copy-on-write; swapped pages are read back into a private
+ * frame for the child.
+ */
+int pte_share(pte_t *old, pte_t *new, struct addrspace *newas, vaddr_t vaddr)
+{
+	*new = 0;
+
+	struct cm_sharer *sh = kmalloc(sizeof(*sh));
+	if (sh == NULL)
+		return ENOMEM;
+
+	spinlock_acquire(&coremap_lock);
+	while (*old & PTE_MIGRATING) {
+		spinlock_release(&coremap_lock);
+		vm_pager_barrier();
+		spinlock_acquire(&coremap_lock);
+	}
+	if (*old & PTE_VALID) {
+		/* shared frames cannot be evicted from under the new entry */
+		rmap_add((*old & PTE_FRAME) / PAGE_SIZE - coremap_start,
+			 newas, vaddr, sh);
+		*old |= PTE_READONLY;
+		*new = *old;
+		newas->rss++;
+		spinlock_release(&coremap_lock);
+		return 0;
+	}
+	bool swapped = (*old & PTE_SWAPPED) != 0;
+	spinlock_release(&coremap_lock);
+	kfree(sh);
+	if (!swapped)
+		return 0;
+
+	paddr_t paddr = allocate_user_page(newas, vaddr, PAGE_NOZERO);
+	if (paddr == 0)
+		return ENOMEM;
+	swap_acquire();
+	unsigned int slot = PTE_SLOT(*old);
+	int result = swap_read(slot, paddr);
+	swap_release();
+	if (result)
+		panic("vm: swap read of slot %u failed: %s\n", slot, strerror(result));
+	pte_install(new, paddr, CM_NONE);
+	return 0;
+}
+
+/*
+ * Drop whatever backs the page table entry for vaddr in as: its
+ * mapping of a frame or its swap slot.
+ */
+void pte_release(struct addrspace *as, vaddr_t vaddr, pte_t *pte)
+{
+	spinlock_acquire(&coremap_lock);
+	while (*pte & PTE_MIGRATING) {
+		spinlock_release(&coremap_lock);
+		vm_pager_barrier();
+		spinlock_acquire(&coremap_lock);
+	}
+	pte_t entry = *pte;
+	*pte = 0;
+	spinlock_release(&coremap_lock);
+
+	if (entry & PTE_VALID) {
+		page_unmap(entry & PTE_FRAME, as, vaddr);
+	} else if (entry & PTE_SWAPPED) {
+		/* waits for an eviction of this page to finish */
+		swap_acquire();
+		swap_free(PTE_SLOT(entry));
+		swap_release();
+	}
+}
+
+/*
+ * Unmap npages pages of as from start and free what they held. Unlike
+ * calling pte_release on each, this takes coremap_lock once per batch
+ * of RELEASE_BATCH pages, gives frames straight back to the buddy
+ * lists, and skips page tables that were never allocated. The caller
+ * must already have shot down the TLB entries. Returns the number of
+ * pages that were mapped.
+ */
+#define RELEASE_BATCH	32
+
+unsigned int pte_release_range(struct addrspace *as, vaddr_t start,
+			       unsigned int npages)
+{
+	vaddr_t va = start, end = start + npages * PAGE_SIZE;
+	unsigned int slots[RELEASE_BATCH];
+	struct cm_sharer *dead[RELEASE_BATCH];
+	unsigned int released = 0;
+
+	while (va < end) {
+		unsigned int nslots = 0, ndead = 0;
+		bool moving = false;
+
+		spinlock_acquire(&coremap_lock);
+		for (unsigned int n = 0; n < RELEASE_BATCH && va < end; n++) {
+			struct second_level_page_table *pt =
+				as->first->second_levels[PT1_INDEX(va)];
+			if (pt == NULL) {
+				/* nothing mapped up to the next table */
+				va = (va & ~(vaddr_t) 0x003FFFFF) + 0x00400000;
+				if (va == 0)
+					va = end;
+				continue;
+			}
+			pte_t *pte = &pt->entries[PT2_INDEX(va)];
+			pte_t entry = *pte;
+			if (entry & PTE_MIGRATING) {
+				/* come back to it when the move is done */
+				moving = true;
+				break;
+			}
+			*pte = 0;
+			va += PAGE_SIZE;
+			if (entry & PTE_VALID) {
+				unsigned int index = (entry & PTE_FRAME) / PAGE_SIZE - coremap_start;
+				released++;
+				as->rss--;
+				dead[ndead] = rmap_remove(index, as, va - PAGE_SIZE);
+				if (dead[ndead] != NULL)
+					ndead++;
+				KASSERT(coremap[index].refcount > 0);
+				if (--coremap[index].refcount > 0)
+					continue;
+				if (coremap[index].fc_vnode != NULL)
+					filecache_remove(index);
+				if (coremap[index].swap_slot != CM_NONE)
+					slots[nslots++] = coremap[index].swap_slot;
+				cm_free_run(index, 1);
+				free_places++;
+			} else if (entry & PTE_SWAPPED) {
+				released++;
+				as->swapped--;
+				slots[nslots++] = PTE_SLOT(entry);
+			}
+		}
+		spinlock_release(&coremap_lock);
+
+		while (ndead > 0)
+			kfree(dead[--ndead]);
+		if (moving)
+			vm_pager_barrier();
+		if (nslots > 0) {
+			/* waits for an eviction of any of these to finish */
+			swap_acquire();
+			for (unsigned int k = 0; k < nslots; k++)
+				swap_free(slots[k]);
+			swap_release();
+		}
+	}
+	return released;
+}
+
+static unsigned int filecache_hash(struct vnode *vn, off_t offset)
+{
+	return (((uintptr_t) vn >> 4) ^ (unsigned int) (offset / PAGE_SIZE)) %
+		FILECACHE_BUCKETS;
+}
+
+/* Coremap index of the cached page, or CM_NONE. Needs coremap_lock. */
+static unsigned int filecache_find(struct vnode *vn, off_t offset)
+{
+	unsigned int index = filecache[filecache_hash(vn, offset)];
+	while (index != CM_NONE &&
+	       (coremap[index].fc_vnode != vn || coremap[index].fc_offset != offset))
+		index = coremap[index].fc_next;
+	return index;
+}
+
+static void filecache_insert(unsigned int index, struct vnode *vn, off_t offset)
+{
+	unsigned int bucket = filecache_hash(vn, offset);
+	coremap[index].fc_vnode = vn;
+	coremap[index].fc_offset = offset;
+	coremap[index].fc_next = filecache[bucket];
+	filecache[bucket] = index;
+	filecache_count++;
+}
+
+static void filecache_remove(unsigned int index)
+{
+	unsigned int *link = &filecache[filecache_hash(coremap[index].fc_vnode,
+						       coremap[index].fc_offset)];
+	while (*link != index)
+		link = &coremap[*link].fc_next;
+	*link = coremap[index].fc_next;
+	coremap[index].fc_vnode = NULL;
+	filecache_count--;
+}
+
+/*
+ * Map a page of a read-only file region. If another address space
+ * already has that page of the file, share its frame; otherwise read
+ * it in and enter it in the file cache.
+ */
+static int filecache_map(pte_t *pte, struct addrspace *as,
+			 struct region *r, vaddr_t vaddr)
+{
+	struct vnode *vn = r->reg_vnode;
+	off_t offset = r->reg_offset + (vaddr - r->reg_start);
+	unsigned int index;
+	int result = 0;
+
+	struct cm_sharer *sh = kmalloc(sizeof(*sh));
+	if (sh == NULL)
+		return ENOMEM;
+
+	spinlock_acquire(&coremap_lock);
+	index = filecache_find(vn, offset);
+	if (index != CM_NONE)
+		goto share;
+	filecache_misses++;
+	spinlock_release(&coremap_lock);
+
+	paddr_t paddr = allocate_user_page(as, vaddr, 0);
+	if (paddr == 0) {
+		result = ENOMEM;
+		goto out;
+	}
+	result = page_read_file(r, vaddr, paddr);
+	if (result) {
+		page_decref(paddr);
+		goto out;
+	}
+
+	spinlock_acquire(&coremap_lock);
+	index = filecache_find(vn, offset);
+	if (index == CM_NONE) {
+		filecache_insert(paddr / PAGE_SIZE - coremap_start, vn, offset);
+		spinlock_release(&coremap_lock);
+		pte_install(pte, paddr, CM_NONE);
+		goto out;
+	}
+	/* someone else read it in meanwhile */
+	spinlock_release(&coremap_lock);
+	page_decref(paddr);
+	spinlock_acquire(&coremap_lock);
+	index = filecache_find(vn, offset);
+	if (index == CM_NONE) {
+		/* and it has already gone again; just try once more */
+		spinlock_release(&coremap_lock);
+		goto out;
+	}
+share:
+	filecache_hits++;
+	as->rss++;
+	rmap_add(index, as, vaddr, sh);
+	sh = NULL;
+	*pte = ((coremap_start + index) * PAGE_SIZE) | PTE_VALID |
+		PTE_REFERENCED | PTE_READONLY;
+	spinlock_release(&coremap_lock);
+out:
+	if (sh != NULL)
+		kfree(sh);
+	return result;
+}
+
+/*
+ * Copy the contents of user page vaddr into buf, a page from
+ * alloc_kpages, whether it is resident or in swap. False if the page
+ * has never been touched. *modified says whether it has been written
+ * since it was read from its file (see region_tracks_writes); if not,
+ * nothing is copied.
+ */
+bool vm_copypage(struct addrspace *as, vaddr_t vaddr, void *buf,
+		 bool *modified)
+{
+	pte_t *pte = find_pte(as->first, vaddr);
+	if (pte == NULL)
+		return false;
+
+	/* the pager cannot move the page while we hold these */
+	bool swapping = swap_enabled();
+	if (migrate_lock != NULL)
+		lock_acquire(migrate_lock);
+	if (swapping)
+		swap_acquire();
+	spinlock_acquire(&coremap_lock);
+	pte_t entry = *pte;
+	spinlock_release(&coremap_lock);
+
+	bool found = true;
+	*modified = (entry & PTE_MODIFIED) != 0;
+	if (!*modified) {
+		found = (entry & (PTE_VALID | PTE_SWAPPED)) != 0;
+	} else if (entry & PTE_VALID) {
+		memmove(buf, (const void *) PADDR_TO_KVADDR(entry & PTE_FRAME), PAGE_SIZE);
+	} else if (entry & PTE_SWAPPED) {
+		unsigned int slot = PTE_SLOT(entry);
+		int result = swap_read(slot, (vaddr_t) buf - MIPS_KSEG0);
+		if (result)
+			panic("vm: swap read of slot %u failed: %s\n", slot, strerror(result));
+	} else {
+		found = false;
+	}
+	if (swapping)
+		swap_release();
+	if (migrate_lock != NULL)
+		lock_release(migrate_lock);
+	return found;
+}
+
+/*
+ * Drop this CPU's entries for the range in ts, if it holds entries for
+ * that address space at all. Short ranges are probed page by page,
+ * long ones by reading back every slot. Interrupts must be off.
+ */
+static void tlb_invalidate_range(const struct tlbshootdown *ts)
+{
+	struct tlbstate *tls = &curcpu->c_tlb;
+	vaddr_t end = ts->ts_start + ts->ts_npages * PAGE_SIZE;
+	uint32_t ehi, elo;
+	int i;
+
+	if (tls->ts_tag != ts->ts_tag)
+		return;
+
+	if (ts->ts_npages <= TLBSHOOTDOWN_PROBE) {
+		for (vaddr_t va = ts->ts_start; va < end; va += PAGE_SIZE) {
+			i = tlb_probe(va, 0);
+			if (i >= 0) {
+				tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+				tls->ts_free[tls->ts_nfree++] = i;
+			}
+		}
+		return;
+	}
+	for (i = 0; i < NUM_TLB; i++) {
+		tlb_read(&ehi, &elo, i);
+		vaddr_t va = ehi & TLBHI_VPAGE;
+		if (va >= ts->ts_start && va < end) {
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+			tls->ts_free[tls->ts_nfree++] = i;
+		}
+	}
+}
+
+/*
+ * Invalidate npages pages of as starting at start in every TLB that
+ * may hold them, and wait until they all have. Only CPUs in
+ * as->tlb_cpus are interrupted, with one request for the whole range.
+ */
+void vm_tlbshootdown_range(struct addrspace *as, vaddr_t start,
+			   unsigned int npages)
+{
+	struct tlbshootdown ts = {
+		.ts_start = start,
+		.ts_npages = npages,
+		.ts_tag = as->tlb_tag,
+	};
+
+	int spl = splhigh();
+	tlb_invalidate_range(&ts);
+	uint32_t targets = as->tlb_cpus & ~((uint32_t)1 << curcpu->c_number);
+	splx(spl);
+	if (targets == 0)
+		return;
+
+	lock_acquire(shootdown_lock);
+	spinlock_acquire(&shootdown_spinlock);
+	for (struct tlbstate *tls = tlbstates; tls != NULL; tls = tls->ts_next) {
+		if (targets & ((uint32_t)1 << tls->ts_cpu->c_number))
+			shootdown_pending++;
+	}
+	spinlock_release(&shootdown_spinlock);
+
+	for (struct tlbstate *tls = tlbstates; tls != NULL; tls = tls->ts_next) {
+		if (targets & ((uint32_t)1 << tls->ts_cpu->c_number))
+			ipi_tlbshootdown(tls->ts_cpu, &ts);
+	}
+
+	spinlock_acquire(&shootdown_spinlock);
+	while (shootdown_pending > 0)
+		wchan_sleep(shootdown_wchan, &shootdown_spinlock);
+	spinlock_release(&shootdown_spinlock);
+	lock_release(shootdown_lock);
+}
+
+/* A resident, unshared, unbusy user page. Needs coremap_lock. */
+static bool cm_evictable(const struct cm_listing *cm)
+{
+	return (cm->state == DIRTY || cm->state == CLEAN) &&
+		cm->refcount == 1 && cm->as != NULL && !cm->busy;
+}
+
+/*
+ * May this thread page something out to make room? Not from an
+ * interrupt or under a spinlock, and not from inside the pager.
+ */
+static bool can_page_out(void)
+{
+	return swap_enabled() && CURCPU_EXISTS() && !swap_holding() &&
+		!curthread->t_in_interrupt && curcpu->c_spinlocks == 0;
+}
+
+/*
+ * Page out the frame at index, which must be evictable and have a
+ * swap slot unless it is in the file cache. Called with the swap lock
+ * and coremap_lock held; returns with coremap_lock released and the
+ * frame an unowned FIXED page.
+ */
+static void evict_frame(unsigned int index)
+{
+	struct cm_listing *cm = &coremap[index];
+	paddr_t paddr = (coremap_start + index) * PAGE_SIZE;
+	pte_t *pte = find_pte(cm->as->first, cm->vaddr);
+	KASSERT(pte != NULL && (*pte & PTE_VALID) && (*pte & PTE_FRAME) == paddr);
+	bool dirty = (*pte & PTE_DIRTY) != 0;
+	if (cm->fc_vnode != NULL) {
+		filecache_remove(index);
+		*pte = 0;
+		dirty = false;
+	} else {
+		*pte = PTE_MKSLOT(cm->swap_slot) | PTE_SWAPPED |
+			(*pte & PTE_MODIFIED);
+		cm->as->swapped++;
+	}
+	cm->as->rss--;
+	cm->busy = true;
+	struct addrspace *as = cm->as;
+	vaddr_t vaddr = cm->vaddr;
+	unsigned int slot = cm->swap_slot;
+	spinlock_release(&coremap_lock);
+
+	/* as_destroy waits for the swap lock, so as stays around */
+	vm_tlbshootdown_range(as, vaddr, 1);
+	if (dirty) {
+		int result = swap_write(slot, paddr);
+		if (result)
+			panic("vm: swap write of slot %u failed: %s\n", slot, strerror(result));
+	}
+
+	spinlock_acquire(&coremap_lock);
+	cm_setup(index, 1, 0);
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Second-chance clock: pick a resident, unshared, unbusy user page,
+ * write it to swap if it is dirty, and hand its frame back for reuse.
+ * The frame comes back as an unowned FIXED page; CM_NONE if there is
+ * no victim or no swap space.
+ */
+static unsigned int evict_page(void)
+{
+	swap_acquire();
+	spinlock_acquire(&coremap_lock);
+
+	unsigned int index = CM_NONE;
+	for (unsigned int n = 0; n < 2 * coremap_count; n++) {
+		struct cm_listing *cm = &coremap[clock_hand];
+		unsigned int i = clock_hand;
+		clock_hand = (clock_hand + 1) % coremap_count;
+		if (!cm_evictable(cm))
+			continue;
+		pte_t *pte = find_pte(cm->as->first, cm->vaddr);
+		if (*pte & PTE_REFERENCED) {
+			*pte &= ~PTE_REFERENCED;
+			continue;
+		}
+		/* file cache pages are dropped, not written to swap */
+		if (cm->fc_vnode == NULL && cm->swap_slot == CM_NONE &&
+		    swap_alloc(&cm->swap_slot))
+			continue;
+		index = i;
+		break;
+	}
+	if (index == CM_NONE) {
+		spinlock_release(&coremap_lock);
+		swap_release();
+		return CM_NONE;
+	}
+
+	evict_frame(index);
+	swap_release();
+	return index;
+}
+
+void vm_tlbshootdown_all(void)
+{
+	int spl = splhigh();
+	tlb_flush(&curcpu->c_tlb);
+	splx(spl);
+}
+
+/*
+ * Called on context switch. The TLB is only flushed when it holds
+ * some other address space's entries (or this one's under an old tag).
+ */
+void vm_tlbactivate(struct addrspace *as)
+{
+	int spl = splhigh();
+	struct tlbstate *ts = &curcpu->c_tlb;
+	if (ts->ts_tag == as->tlb_tag) {
+		ts->ts_kept++;
+	} else {
+		tlb_flush(ts);
+		ts->ts_tag = as->tlb_tag;
+	}
+	as->tlb_cpus |= (uint32_t)1 << curcpu->c_number;
+	splx(spl);
+}
+
+/*
+ * Give as a new tag, so that CPUs still holding entries for it under
+ * the old one flush before running it again. Used when mappings go
+ * away or lose write permission without a broadcast shootdown; the
+ * caller takes care of this CPU's own TLB.
+ */
+void vm_tlbretag(struct addrspace *as)
+{
+	spinlock_acquire(&tlb_lock);
+	uint32_t tag = tlb_next_tag++;
+	if (tlb_next_tag == 0)
+		tlb_next_tag = 1;
+	spinlock_release(&tlb_lock);
+
+	int spl = splhigh();
+	struct tlbstate *ts = &curcpu->c_tlb;
+	if (as->tlb_tag != 0 && ts->ts_tag == as->tlb_tag) {
+		ts->ts_tag = tag;
+		as->tlb_cpus = (uint32_t)1 << curcpu->c_number;
+	} else {
+		as->tlb_cpus = 0;
+	}
+	as->tlb_tag = tag;
+	splx(spl);
 }
 
-int vm_fault(int faulttype, vaddr_t faultaddress)
+void tlbstate_init(struct cpu *c)
 {
+	struct tlbstate *ts = &c->c_tlb;
 
-	if (curproc == NULL) 
-		return EFAULT;
-	struct addrspace *as;
+	ts->ts_tag = 0;
+	ts->ts_nfree = 0;
+	ts->ts_victim = 0;
+	ts->ts_misses = ts->ts_refills = 0;
+	ts->ts_flushes = ts->ts_kept = 0;
+	ts->ts_cpu = c;
+	/* as->tlb_cpus has a bit per CPU */
+	KASSERT(c->c_number < 32);
 
-	as = proc_getas();
-	if (as == NULL) 
-		return EFAULT;
+	spinlock_acquire(&tlb_lock);
+	ts->ts_next = tlbstates;
+	tlbstates = ts;
+	spinlock_release(&tlb_lock);
+}
 
-	faultaddress &= PAGE_FRAME;
-	struct region *curr = as->regions;
-	bool belongs = false;
-	while (curr != NULL) {
-		if ((faultaddress >= curr->reg_start && faultaddress < curr->reg_end)) {
-			belongs = true;
+void tlbstate_printstats(void)
+{
+	for (struct tlbstate *ts = tlbstates; ts != NULL; ts = ts->ts_next) {
+		unsigned int switches = ts->ts_flushes + ts->ts_kept;
+		kprintf("cpu%u: %u misses, %u refills, %u flushes, "
+			"%u switches kept the TLB (%u%%)\n",
+			ts->ts_cpu->c_number, ts->ts_misses, ts->ts_refills,
+			ts->ts_flushes, ts->ts_kept,
+			switches ? ts->ts_kept * 100 / switches : 0);
+	}
+}
+
+void vm_tlbshootdown(const struct tlbshootdown *tlbs)
+{
+	int spl = splhigh();
+	tlb_invalidate_range(tlbs);
+	splx(spl);
+
+	/* acknowledge; see vm_tlbshootdown_range() */
+	spinlock_acquire(&shootdown_spinlock);
+	KASSERT(shootdown_pending > 0);
+	if (--shootdown_pending == 0)
+		wchan_wakeall(shootdown_wchan, &shootdown_spinlock);
+	spinlock_release(&shootdown_spinlock);
+}
+
+/*
+ * Buddy free lists. free_heads[k] is the first free block of 2^k pages.
+ * Everything below is protected by coremap_lock.
+ */
+static unsigned int free_heads[CM_MAX_ORDER + 1];
+
+static void cm_list_push(unsigned int index, int order)
+{
+	coremap[index].order = order;
+	coremap[index].prev_free = CM_NONE;
+	coremap[index].next_free = free_heads[order];
+	if (free_heads[order] != CM_NONE)
+		coremap[free_heads[order]].prev_free = index;
+	free_heads[order] = index;
+}
+
+static void cm_list_remove(unsigned int index)
+{
+	struct cm_listing *cm = &coremap[index];
+	if (cm->prev_free != CM_NONE)
+		coremap[cm->prev_free].next_free = cm->next_free;
+	else
+		free_heads[cm->order] = cm->next_free;
+	if (cm->next_free != CM_NONE)
+		coremap[cm->next_free].prev_free = cm->prev_free;
+	cm->order = CM_NOORDER;
+}
+
+/*
+ * Put a free block back on the lists, merging it with its buddy for
+ * as long as the buddy is a free block of the same size.
+ */
+static void cm_free_block(unsigned int index, int order)
+{
+	while (order < CM_MAX_ORDER) {
+		unsigned int buddy = index ^ (1u << order);
+		if (buddy + (1u << order) > coremap_count)
+			break;
+		if (coremap[buddy].state != FREE || coremap[buddy].order != order)
 			break;
+		cm_list_remove(buddy);
+		if (buddy < index)
+			index = buddy;
+		order++;
+	}
+	cm_list_push(index, order);
+}
+
+/*
+ * Release an arbitrary run of pages by splitting it into the largest
+ * aligned power-of-two blocks it contains. Does not touch free_places.
+ */
+static void cm_free_run(unsigned int index, unsigned int npages)
+{
+	while (npages > 0) {
+		int order = 0;
+		while (order < CM_MAX_ORDER &&
+		       (index & ((1u << (order + 1)) - 1)) == 0 &&
+		       (1u << (order + 1)) <= npages)
+			order++;
+		for (unsigned int i = index; i < index + (1u << order); i++)
+			coremap[i] = (struct cm_listing) {.page_count = 0, .state = FREE, .order = CM_NOORDER, .swap_slot = CM_NONE};
+		cm_free_block(index, order);
+		index += 1u << order;
+		npages -= 1u << order;
+	}
+}
+
+/*
+ * Take a free block of exactly 2^order pages, splitting a larger one
+ * if necessary. Returns CM_NONE if nothing big enough is free.
+ */
+static unsigned int cm_take_block(int order)
+{
+	int k = order;
+	while (k <= CM_MAX_ORDER && free_heads[k] == CM_NONE)
+		k++;
+	if (k > CM_MAX_ORDER)
+		return CM_NONE;
+
+	unsigned int index = free_heads[k];
+	cm_list_remove(index);
+	while (k > order) {
+		k--;
+		cm_list_push(index + (1u << k), k);
+	}
+	return index;
+}
+
+static paddr_t cm_claim(unsigned int index, unsigned int npages, int type)
+{
+	cm_setup(index, npages, type);
+	free_places -= npages;
+	return (coremap_start + index) * PAGE_SIZE;
+}
+
+/*
+ * For when no free block of 2^order pages is left: find the aligned
+ * block that holds only free and evictable pages, and the fewest of
+ * the latter, and page those out. The block then forms on the buddy
+ * lists by merging as its pages are freed, though another allocation
+ * may still get to it first. Returns false if no block can be cleared.
+ */
+static bool cm_reclaim_run(int order)
+{
+	unsigned int size = 1u << order;
+	unsigned int best = CM_NONE, best_used = size + 1;
+	unsigned int start, i, used;
+
+	swap_acquire();
+	spinlock_acquire(&coremap_lock);
+	for (start = 0; start + size <= coremap_count; start += size) {
+		used = 0;
+		for (i = start; i < start + size && used < best_used; i++) {
+			if (coremap[i].state == FREE)
+				continue;
+			if (!cm_evictable(&coremap[i])) {
+				used = best_used;
+				break;
+			}
+			used++;
+		}
+		if (used < best_used) {
+			best = start;
+			best_used = used;
+		}
+	}
+	spinlock_release(&coremap_lock);
+	if (best == CM_NONE)
+		goto fail;
+
+	for (i = best; i < best + size; i++) {
+		spinlock_acquire(&coremap_lock);
+		struct cm_listing *cm = &coremap[i];
+		if (cm->state == FREE) {
+			spinlock_release(&coremap_lock);
+			continue;
+		}
+		if (!cm_evictable(cm) || (cm->fc_vnode == NULL &&
+		    cm->swap_slot == CM_NONE && swap_alloc(&cm->swap_slot))) {
+			/* taken meanwhile, or out of swap */
+			spinlock_release(&coremap_lock);
+			goto fail;
 		}
-		curr = curr->next_region;
+		evict_frame(i);
+		spinlock_acquire(&coremap_lock);
+		cm_free_run(i, 1);
+		free_places++;
+		spinlock_release(&coremap_lock);
+		run_reclaim_pages++;
 	}
-	if (!belongs && faultaddress >= as->heap->reg_start && faultaddress < as->heap->reg_end) {
-		belongs = true;
+	swap_release();
+	run_reclaims++;
+	return true;
+
+fail:
+	swap_release();
+	run_reclaim_failures++;
+	return false;
+}
+
+/*
+ * Wait for any eviction or page move in progress to finish. Used by
+ * whoever finds a PTE_MIGRATING entry, and by as_destroy before the
+ * address space goes.
+ */
+void vm_pager_barrier(void)
+{
+	if (swap_enabled()) {
+		swap_acquire();
+		swap_release();
 	}
-	enum direction_alloc direction = POSITIVE;
-	if (!belongs && faultaddress >= (USERSTACK - 3000 * PAGE_SIZE) && faultaddress < USERSTACK) {
-		direction = NEGATIVE;
-		belongs = true;
+	if (migrate_lock != NULL) {
+		lock_acquire(migrate_lock);
+		lock_release(migrate_lock);
 	}
-	if (!belongs) 
-		return EFAULT;
-	
-	uint32_t ehi, elo;
-	int spl;
+}
 
-	struct page_table_entry *pte = find_pte(as->first, faultaddress);
-	if (pte == NULL) {
-		if (alloc_region(as->first, faultaddress, 1, direction)) {
-			return ENOMEM;
+/* A mapped user page nobody is paging or moving. Needs coremap_lock. */
+static bool cm_movable(const struct cm_listing *cm)
+{
+	return (cm->state == DIRTY || cm->state == CLEAN) &&
+		cm->as != NULL && !cm->busy;
+}
+
+/*
+ * Take a free page outside [lo, hi), splitting the smallest free
+ * block that lies wholly outside. Needs coremap_lock.
+ */
+static unsigned int cm_take_outside(unsigned int lo, unsigned int hi)
+{
+	for (int k = 0; k <= CM_MAX_ORDER; k++) {
+		unsigned int b;
+		for (b = free_heads[k]; b != CM_NONE; b = coremap[b].next_free) {
+			if (b + (1u << k) <= lo || b >= hi)
+				break;
 		}
+		if (b == CM_NONE)
+			continue;
+		cm_list_remove(b);
+		while (k > 0) {
+			k--;
+			cm_list_push(b + (1u << k), k);
+		}
+		cm_setup(b, 1, 0);
+		free_places--;
+		return b;
 	}
-	pte = find_pte(as->first, faultaddress);
-	if (!pte->is_valid) {
-		pte->base = allocate_one_page(1);
-		if (pte->base == 0) //user page
-			return ENOMEM;
-		pte->is_valid = 1;
+	return CM_NONE;
+}
+
+/*
+ * Move the user page at src to a free frame outside [lo, hi). Its
+ * entries are marked PTE_MIGRATING and shot down before the copy, so
+ * nobody can write to it meanwhile, and pointed at the new frame
+ * after. Called with migrate_lock held.
+ */
+static bool migrate_frame(unsigned int src, unsigned int lo, unsigned int hi)
+{
+	struct cm_listing *cm = &coremap[src];
+	paddr_t from = (coremap_start + src) * PAGE_SIZE;
+	struct cm_sharer *m;
+	struct vnode *vn = NULL;
+	off_t offset = 0;
+	pte_t *pte;
+
+	KASSERT(lock_do_i_hold(migrate_lock));
+	spinlock_acquire(&coremap_lock);
+	if (!cm_movable(cm))
+		goto fail;
+	/* the first mapping, as a list node, so one loop sees them all */
+	struct cm_sharer first = {
+		.sh_as = cm->as, .sh_vaddr = cm->vaddr, .sh_next = cm->sharers,
+	};
+	for (m = &first; m != NULL; m = m->sh_next) {
+		pte = find_pte(m->sh_as->first, m->sh_vaddr);
+		/* may be on its way out under pte_release */
+		if (pte == NULL || !(*pte & PTE_VALID) || (*pte & PTE_FRAME) != from)
+			goto fail;
 	}
+	unsigned int dst = cm_take_outside(lo, hi);
+	if (dst == CM_NONE)
+		goto fail;
+	paddr_t to = (coremap_start + dst) * PAGE_SIZE;
 
-	(void) faulttype;
-	
-	spinlock_acquire(&tlb_lock);
-	spl = splhigh();
-	paddr_t paddr = (pte->base);
-	ehi = faultaddress;
-	elo = paddr | TLBLO_VALID| TLBLO_DIRTY;
-	tlb_write(ehi, elo, tlb_index);
-	tlb_index = (tlb_index + 1) % NUM_TLB;
-	splx(spl);
-	spinlock_release(&tlb_lock);
+	cm->busy = true;
+	if (cm->fc_vnode != NULL) {
+		/* faults meanwhile read their own copy */
+		vn = cm->fc_vnode;
+		offset = cm->fc_offset;
+		filecache_remove(src);
+	}
+	for (m = &first; m != NULL; m = m->sh_next) {
+		pte = find_pte(m->sh_as->first, m->sh_vaddr);
+		*pte = (*pte & ~PTE_VALID) | PTE_MIGRATING;
+	}
+	spinlock_release(&coremap_lock);
 
-	return 0;
+	/* everyone who could change the mappings waits for us */
+	for (m = &first; m != NULL; m = m->sh_next)
+		vm_tlbshootdown_range(m->sh_as, m->sh_vaddr, 1);
+	memmove((void *) PADDR_TO_KVADDR(to), (const void *) PADDR_TO_KVADDR(from),
+		PAGE_SIZE);
+
+	spinlock_acquire(&coremap_lock);
+	struct cm_listing *new = &coremap[dst];
+	new->state = cm->state;
+	new->refcount = cm->refcount;
+	new->as = cm->as;
+	new->vaddr = cm->vaddr;
+	new->sharers = cm->sharers;
+	new->swap_slot = cm->swap_slot;
+	new->zeroed = false;
+	for (m = &first; m != NULL; m = m->sh_next) {
+		pte = find_pte(m->sh_as->first, m->sh_vaddr);
+		*pte = (*pte & ~(PTE_FRAME | PTE_MIGRATING)) | to | PTE_VALID;
+	}
+	if (vn != NULL && filecache_find(vn, offset) == CM_NONE)
+		filecache_insert(dst, vn, offset);
+	cm_free_run(src, 1);
+	free_places++;
+	spinlock_release(&coremap_lock);
+	pages_migrated++;
+	return true;
+
+fail:
+	spinlock_release(&coremap_lock);
+	return false;
 }
 
-void vm_tlbshootdown_all(void)
+/*
+ * Open up a free block of 2^order pages by moving user pages out of
+ * the aligned block that holds nothing else and the fewest of them.
+ * Unlike cm_reclaim_run this needs no swap and keeps everything
+ * resident. The block may still be taken by someone else before the
+ * caller gets to it.
+ */
+bool vm_compact(int order)
 {
-	spinlock_acquire(&tlb_lock);
-	int spl = splhigh();
+	unsigned int size = 1u << order;
+	unsigned int best = CM_NONE, best_used = size + 1;
+	unsigned int start, i, used, free_inside = 0;
+	bool ok = false;
 
-	for (int i = 0; i < NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	if (order < 0 || order > CM_MAX_ORDER || migrate_lock == NULL)
+		return false;
+	lock_acquire(migrate_lock);
+	compact_runs++;
+
+	spinlock_acquire(&coremap_lock);
+	for (start = 0; start + size <= coremap_count; start += size) {
+		used = 0;
+		for (i = start; i < start + size && used < best_used; i++) {
+			if (coremap[i].state == FREE)
+				continue;
+			if (!cm_movable(&coremap[i])) {
+				used = best_used;
+				break;
+			}
+			used++;
+		}
+		if (used < best_used) {
+			best = start;
+			best_used = used;
+		}
 	}
+	if (best != CM_NONE)
+		free_inside = size - best_used;
+	/* the pages have to fit somewhere else */
+	if (best != CM_NONE && free_places - free_inside < best_used)
+		best = CM_NONE;
+	spinlock_release(&coremap_lock);
+	if (best == CM_NONE)
+		goto done;
 
-	splx(spl);
-	spinlock_release(&tlb_lock);
+	for (i = best; i < best + size; i++) {
+		if (coremap[i].state != FREE && !migrate_frame(i, best, best + size))
+			goto done;
+	}
+	ok = true;
+done:
+	if (!ok)
+		compact_failures++;
+	lock_release(migrate_lock);
+	return ok;
 }
 
-void vm_tlbshootdown(const struct tlbshootdown *tlbs)
+/* May this thread run a compaction? As for paging, minus the swap. */
+static bool can_migrate(void)
+{
+	return migrate_lock != NULL && CURCPU_EXISTS() &&
+		!curthread->t_in_interrupt && curcpu->c_spinlocks == 0 &&
+		!lock_do_i_hold(migrate_lock) && !swap_holding();
+}
+
+/*
+ * Free memory by block size, and for each size the share of free
+ * memory in blocks too small for it, which is what compaction is for.
+ */
+void vm_fragstats(void)
+{
+	unsigned int blocks[CM_MAX_ORDER + 1];
+	unsigned int listed = 0, below = 0;
+	int k, largest = -1;
+
+	spinlock_acquire(&coremap_lock);
+	for (k = 0; k <= CM_MAX_ORDER; k++) {
+		blocks[k] = 0;
+		for (unsigned int b = free_heads[k]; b != CM_NONE; b = coremap[b].next_free)
+			blocks[k]++;
+		listed += blocks[k] << k;
+		if (blocks[k] > 0)
+			largest = k;
+	}
+	spinlock_release(&coremap_lock);
+
+	kprintf("order  blocks   pages  unusable\n");
+	for (k = 0; k <= CM_MAX_ORDER; k++) {
+		kprintf("%5d %7u %7u %8u%%\n", k, blocks[k], blocks[k] << k,
+			listed ? below * 100 / listed : 0);
+		below += blocks[k] << k;
+	}
+	kprintf("%u pages on the free lists, largest block %u pages\n",
+		listed, largest < 0 ? 0 : 1u << largest);
+	kprintf("compaction: %u runs, %u failed, %u pages moved\n",
+		compact_runs, compact_failures, pages_migrated);
+}
+
+static struct pagecache *pagecaches;
+
+/* Pages sitting in per-cpu caches. Racy, but only used for reporting. */
+static unsigned int pagecache_count(void)
+{
+	unsigned int count = 0;
+	for (struct pagecache *pc = pagecaches; pc != NULL; pc = pc->pc_next)
+		count += pc->pc_count;
+	return count;
+}
+
+void pagecache_init(struct cpu *c)
+{
+	struct pagecache *pc = &c->c_pagecache;
+
+	spinlock_init(&pc->pc_lock);
+	pc->pc_count = 0;
+	pc->pc_hits = pc->pc_misses = 0;
+	pc->pc_refills = pc->pc_drains = 0;
+	pc->pc_cpu = c;
+
+	spinlock_acquire(&coremap_lock);
+	pc->pc_next = pagecaches;
+	pagecaches = pc;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * Move pages from the buddy lists into a cache until it holds
+ * PAGECACHE_BATCH pages. Called with pc_lock held.
+ */
+static void pagecache_refill(struct pagecache *pc)
+{
+	spinlock_acquire(&coremap_lock);
+	while (pc->pc_count < PAGECACHE_BATCH) {
+		unsigned int index = cm_take_block(0);
+		if (index == CM_NONE)
+			break;
+		coremap[index].state = FIXED;
+		coremap[index].page_count = 0;
+		pc->pc_pages[pc->pc_count++] = index;
+		free_places--;
+	}
+	spinlock_release(&coremap_lock);
+	pc->pc_refills++;
+}
+
+/*
+ * Give pages back to the buddy lists until only keep are cached.
+ * Called with pc_lock held.
+ */
+static void pagecache_drain(struct pagecache *pc, unsigned int keep)
+{
+	spinlock_acquire(&coremap_lock);
+	while (pc->pc_count > keep) {
+		cm_free_run(pc->pc_pages[--pc->pc_count], 1);
+		free_places++;
+	}
+	spinlock_release(&coremap_lock);
+	pc->pc_drains++;
+}
+
+/*
+ * Empty every cpu's cache. Used when the buddy lists run dry so that
+ * pages stranded in other caches can still be allocated.
+ */
+static void pagecache_reclaim(void)
+{
+	for (struct pagecache *pc = pagecaches; pc != NULL; pc = pc->pc_next) {
+		spinlock_acquire(&pc->pc_lock);
+		if (pc->pc_count > 0)
+			pagecache_drain(pc, 0);
+		spinlock_release(&pc->pc_lock);
+	}
+}
+
+static unsigned int pagecache_get(int type)
+{
+	struct pagecache *pc = &curcpu->c_pagecache;
+	unsigned int index = CM_NONE;
+
+	spinlock_acquire(&pc->pc_lock);
+	if (pc->pc_count == 0) {
+		pc->pc_misses++;
+		pagecache_refill(pc);
+	} else {
+		pc->pc_hits++;
+	}
+	if (pc->pc_count > 0) {
+		index = pc->pc_pages[--pc->pc_count];
+		cm_setup(index, 1, type);
+	}
+	spinlock_release(&pc->pc_lock);
+	return index;
+}
+
+static void pagecache_put(unsigned int index)
+{
+	struct pagecache *pc = &curcpu->c_pagecache;
+
+	spinlock_acquire(&pc->pc_lock);
+	if (pc->pc_count == PAGECACHE_SIZE)
+		pagecache_drain(pc, PAGECACHE_BATCH);
+	coremap[index].state = FIXED;
+	coremap[index].page_count = 0;
+	pc->pc_pages[pc->pc_count++] = index;
+	spinlock_release(&pc->pc_lock);
+}
+
+void pagecache_printstats(void)
+{
+	for (struct pagecache *pc = pagecaches; pc != NULL; pc = pc->pc_next) {
+		unsigned int total = pc->pc_hits + pc->pc_misses;
+		kprintf("cpu%u: %u cached, %u hits, %u misses (%u%% hit), "
+			"%u refills, %u drains\n",
+			pc->pc_cpu->c_number, pc->pc_count, pc->pc_hits,
+			pc->pc_misses, total ? pc->pc_hits * 100 / total : 0,
+			pc->pc_refills, pc->pc_drains);
+	}
+	kprintf("zero pool: %u pages, %u hits, %u misses, %u pages cleared\n",
+		zero_count, zero_hits, zero_misses, zero_cleared);
+	kprintf("file cache: %u pages, %u hits, %u misses\n",
+		filecache_count, filecache_hits, filecache_misses);
+}
+
+/*
+ * Take a page from the zero pool, waking the zeroer if the pool is
+ * running low. CM_NONE if the pool is empty.
+ */
+static unsigned int zeropool_get(void)
+{
+	unsigned int index;
+
+	spinlock_acquire(&zero_lock);
+	index = zero_pool;
+	if (index == CM_NONE) {
+		zero_misses++;
+	} else {
+		zero_pool = coremap[index].next_free;
+		zero_count--;
+		zero_hits++;
+	}
+	if (zero_count < ZEROPOOL_LOW && zero_wchan != NULL)
+		wchan_wakeone(zero_wchan, &zero_lock);
+	spinlock_release(&zero_lock);
+	return index;
+}
+
+/*
+ * Give every pooled page back to the buddy lists. They stay marked
+ * zeroed, so they still need no clearing when allocated from there.
+ */
+static void zeropool_reclaim(void)
+{
+	spinlock_acquire(&zero_lock);
+	unsigned int index = zero_pool;
+	unsigned int count = zero_count;
+	zero_pool = CM_NONE;
+	zero_count = 0;
+	spinlock_release(&zero_lock);
+
+	spinlock_acquire(&coremap_lock);
+	while (index != CM_NONE) {
+		unsigned int next = coremap[index].next_free;
+		coremap[index].state = FREE;
+		cm_free_block(index, 0);
+		index = next;
+	}
+	free_places += count;
+	spinlock_release(&coremap_lock);
+}
+
+/*
+ * The zeroer: keeps the zero pool topped up with pages from the buddy
+ * lists, one page per turn and only while no other thread on this CPU
+ * is waiting to run.
+ */
+static void zeroer_thread(void *data1, unsigned long data2)
 {
-	(void) tlbs;
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		spinlock_acquire(&zero_lock);
+		while (zero_count >= ZEROPOOL_TARGET)
+			wchan_sleep(zero_wchan, &zero_lock);
+		spinlock_release(&zero_lock);
+
+		if (!threadlist_isempty(&curcpu->c_runqueue)) {
+			thread_yield();
+			continue;
+		}
+
+		unsigned int index = CM_NONE;
+		spinlock_acquire(&coremap_lock);
+		if (free_places > ZEROPOOL_RESERVE) {
+			index = cm_take_block(0);
+			if (index != CM_NONE) {
+				coremap[index].state = FIXED;
+				coremap[index].order = CM_NOORDER;
+				coremap[index].page_count = 0;
+				free_places--;
+			}
+		}
+		spinlock_release(&coremap_lock);
+
+		if (index == CM_NONE) {
+			/* memory is short; wait until allocations drain the pool */
+			spinlock_acquire(&zero_lock);
+			wchan_sleep(zero_wchan, &zero_lock);
+			spinlock_release(&zero_lock);
+			continue;
+		}
+
+		if (!coremap[index].zeroed) {
+			bzero((void *) PADDR_TO_KVADDR((coremap_start + index) * PAGE_SIZE), PAGE_SIZE);
+			coremap[index].zeroed = true;
+			zero_cleared++;
+		}
+
+		spinlock_acquire(&zero_lock);
+		coremap[index].next_free = zero_pool;
+		zero_pool = index;
+		zero_count++;
+		spinlock_release(&zero_lock);
+	}
 }
 
 void cm_bootstrap(void)
@@ -116,37 +1924,25 @@ void cm_bootstrap(void)
 	first_free = first_free + ROUNDUP(pages * sizeof(struct cm_listing), PAGE_SIZE);
 	coremap_start = first_free / PAGE_SIZE;
 	coremap_count = free_places = ((last - first_free) / PAGE_SIZE);
-	for (unsigned i = 0; i < coremap_count; i++) {
-		coremap[i] = (struct cm_listing) {.page_count = 0, .state = FREE};
+	for (int k = 0; k <= CM_MAX_ORDER; k++) {
+		free_heads[k] = CM_NONE;
+	}
+	for (int k = 0; k < FILECACHE_BUCKETS; k++) {
+		filecache[k] = CM_NONE;
 	}
+	cm_free_run(0, coremap_count);
 	spinlock_init(&coremap_lock);
-}
-
-paddr_t allocate_page(unsigned int free_entry_index, int type)
-{
-	if(type == 0) //kernel page
-		coremap[free_entry_index].state = FIXED;
-	else
-		coremap[free_entry_index].state = DIRTY;
-	free_places--;
-	paddr_t paddr = (coremap_start + free_entry_index) * PAGE_SIZE;
-	bzero((void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE);
-	return paddr;
-}
-
-void free_page(unsigned int used_entry_index)
-{
-	free_places++;
-	coremap[used_entry_index] = (struct cm_listing) {.page_count = 0, .state = FREE};
+	pressure_low = coremap_count / PRESSURE_LOW_FRACTION;
+	pressure_high = coremap_count / PRESSURE_HIGH_FRACTION;
 }
 
 vaddr_t alloc_kpages(unsigned npages)
 {
 	paddr_t pa = 0;
 	if (npages == 1) 
-		pa = allocate_one_page(0); // kernel page
+		pa = allocate_one_page(0, PAGE_NOZERO); // kernel page
 	 else if (npages > 1) 
-		pa = allocate_multiple_pages(0, npages); // kernel page
+		pa = allocate_multiple_pages(0, npages, PAGE_NOZERO); // kernel page
 
 	if (pa != 0) 
 		return PADDR_TO_KVADDR(pa);
@@ -158,16 +1954,14 @@ void free_kpages(vaddr_t addr)
 {
 	paddr_t paddr = (addr)-MIPS_KSEG0;
 	unsigned int index =  (paddr / PAGE_SIZE) - coremap_start;
-	if (index <= coremap_count) {
+	if (index < coremap_count) {
 		unsigned int chunk_size = coremap[index].page_count;
-		if (chunk_size > 0) {
+		if (chunk_size == 1 && CURCPU_EXISTS()) {
+			pagecache_put(index);
+		} else if (chunk_size > 0) {
 			spinlock_acquire(&coremap_lock);
-			if (chunk_size == 1) {
-				free_page(index);
-			} else {
-				for (unsigned int i = index; i < index + chunk_size; ++i) 
-					free_page(i);
-			}
+			cm_free_run(index, chunk_size);
+			free_places += chunk_size;
 			spinlock_release(&coremap_lock);
 		}
 		else
@@ -175,61 +1969,223 @@ void free_kpages(vaddr_t addr)
 	}
 }
 
+void kpage_settag(vaddr_t vaddr, unsigned int tag)
+{
+	unsigned int index = (vaddr - MIPS_KSEG0) / PAGE_SIZE - coremap_start;
+	if (index < coremap_count)
+		coremap[index].km_tag = tag;
+}
+
+unsigned int kpage_gettag(vaddr_t vaddr)
+{
+	unsigned int index = (vaddr - MIPS_KSEG0) / PAGE_SIZE - coremap_start;
+	return index < coremap_count ? coremap[index].km_tag : 0;
+}
+
 unsigned int coremap_used_bytes()
 {
-	int  occupied = coremap_count - free_places;
+	int  occupied = coremap_count - free_places - pagecache_count() - zero_count;
 	return occupied * PAGE_SIZE;
 }
 
-paddr_t allocate_multiple_pages(int type, unsigned int npages)
+/*
+ * Reference counting for user frames shared copy-on-write. A frame
+ * starts with one reference when allocated; page_decref frees it when
+ * the last address space lets go.
+ */
+void page_incref(paddr_t paddr)
 {
-	if (free_places > npages) {
-		spinlock_acquire(&coremap_lock);
-		unsigned int index = 0;
-		unsigned int chunk_size = 0;
-		for (unsigned int i = 0; i < coremap_count; i++) {
-			if (chunk_size == npages) 
-				break;
-			if (chunk_size <= 0 && coremap[i].state == FREE) {
-				index = i;
-				chunk_size = 1;
-			} else if (chunk_size > 0 && coremap[i].state == FREE) {
-				chunk_size++;
-			} else if (chunk_size > 0) {
-				chunk_size = 0;
-			}
+	unsigned int index = paddr / PAGE_SIZE - coremap_start;
+	KASSERT(index < coremap_count);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[index].refcount > 0);
+	coremap[index].refcount++;
+	spinlock_release(&coremap_lock);
+}
+
+void page_decref(paddr_t paddr)
+{
+	unsigned int index = paddr / PAGE_SIZE - coremap_start;
+	unsigned int slot = CM_NONE;
+	KASSERT(index < coremap_count);
+
+	spinlock_acquire(&coremap_lock);
+	KASSERT(coremap[index].refcount > 0);
+	bool last = --coremap[index].refcount == 0;
+	if (last) {
+		if (coremap[index].fc_vnode != NULL)
+			filecache_remove(index);
+		slot = coremap[index].swap_slot;
+		coremap[index].as = NULL;
+		coremap[index].swap_slot = CM_NONE;
+	}
+	spinlock_release(&coremap_lock);
+
+	if (last) {
+		if (slot != CM_NONE) {
+			swap_acquire();
+			swap_free(slot);
+			swap_release();
 		}
-		if (chunk_size == npages) {
-			for (unsigned int i = index; i < index + chunk_size; ++i) 
-				allocate_page(i, type);
-			coremap[index].page_count = chunk_size;
-			spinlock_release(&coremap_lock);
-			return (coremap_start + index) * PAGE_SIZE;
+		free_kpages(PADDR_TO_KVADDR(paddr));
+	}
+}
+
+/*
+ * Allocate a frame for user page vaddr of as, evicting a page if
+ * memory is full. The frame is busy until pte_install() maps it.
+ */
+paddr_t allocate_user_page(struct addrspace *as, vaddr_t vaddr, int flags)
+{
+	paddr_t paddr = allocate_one_page(1, flags);
+	if (paddr == 0)
+		return 0;
+
+	unsigned int index = paddr / PAGE_SIZE - coremap_start;
+	spinlock_acquire(&coremap_lock);
+	coremap[index].as = as;
+	coremap[index].vaddr = vaddr;
+	coremap[index].busy = true;
+	spinlock_release(&coremap_lock);
+	return paddr;
+}
+
+/*
+ * Allocate a whole superpage for as at base, if a free block is at
+ * hand; unlike single pages, never reclaim or evict for one. The
+ * frames come back busy, each a separate single-page allocation.
+ */
+static paddr_t allocate_user_block(struct addrspace *as, vaddr_t base)
+{
+	spinlock_acquire(&coremap_lock);
+	unsigned int index = cm_take_block(SUPERPAGE_ORDER);
+	if (index != CM_NONE) {
+		for (unsigned int i = 0; i < SUPERPAGE_PAGES; i++) {
+			cm_setup(index + i, 1, 1);
+			coremap[index + i].as = as;
+			coremap[index + i].vaddr = base + i * PAGE_SIZE;
+			coremap[index + i].busy = true;
 		}
+		free_places -= SUPERPAGE_PAGES;
+	}
+	spinlock_release(&coremap_lock);
+	if (index == CM_NONE)
+		return 0;
 
-		spinlock_release(&coremap_lock);
+	paddr_t paddr = (coremap_start + index) * PAGE_SIZE;
+	for (unsigned int i = 0; i < SUPERPAGE_PAGES; i++) {
+		if (!coremap[index + i].zeroed)
+			bzero((void *) PADDR_TO_KVADDR(paddr + i * PAGE_SIZE), PAGE_SIZE);
+		coremap[index + i].zeroed = false;
 	}
-	return 0;
+	return paddr;
+}
+
+unsigned int coremap_free_pages(void)
+{
+	return free_places + pagecache_count() + zero_count;
 }
 
-paddr_t allocate_one_page(int type)
+paddr_t allocate_multiple_pages(int type, unsigned int npages, int flags)
 {
+	int order = 0;
+	while (order <= CM_MAX_ORDER && (1u << order) < npages)
+		order++;
+	if (order > CM_MAX_ORDER)
+		return 0;
+
 	paddr_t paddr = 0;
-	if (free_places >= 1) {
-		spinlock_acquire(&coremap_lock);
-		int index = -1;
-		for (unsigned i = 0; i < coremap_count; i++) {
-			if (coremap[i].state == FREE) {
-				index = i;
+	for (int tries = 0; tries < 4 && paddr == 0; tries++) {
+		if (tries == 1) {
+			kheap_reclaim();
+			pagecache_reclaim();
+			zeropool_reclaim();
+		} else if (tries == 2) {
+			/* move pages out of the way; failing that, page them out */
+			if (!can_migrate() || !vm_compact(order))
+				continue;
+		} else if (tries == 3) {
+			if (!can_page_out() || !cm_reclaim_run(order))
 				break;
-			}
 		}
-		if (index >= 0) {
-			paddr = allocate_page((unsigned int) index, type);
-			coremap[index].page_count = 1;
+		if (free_places < npages)
+			continue;
+		spinlock_acquire(&coremap_lock);
+		unsigned int index = cm_take_block(order);
+		if (index != CM_NONE) {
+			/* give back the part of the block we don't need */
+			cm_free_run(index + npages, (1u << order) - npages);
+			paddr = cm_claim(index, npages, type);
 		}
 		spinlock_release(&coremap_lock);
 	}
+	vm_pressure_update();
+	if (paddr == 0)
+		return 0;
+	unsigned int index = paddr / PAGE_SIZE - coremap_start;
+	for (unsigned int i = 0; i < npages; i++) {
+		if (!(flags & PAGE_NOZERO) && !coremap[index + i].zeroed)
+			bzero((void *) PADDR_TO_KVADDR(paddr + i * PAGE_SIZE), PAGE_SIZE);
+		coremap[index + i].zeroed = false;
+	}
 	return paddr;
 }
 
+paddr_t allocate_one_page(int type, int flags)
+{
+	paddr_t paddr = 0;
+	unsigned int index = CM_NONE;
+	if (!(flags & PAGE_NOZERO) && CURCPU_EXISTS()) {
+		index = zeropool_get();
+		if (index != CM_NONE) {
+			spinlock_acquire(&coremap_lock);
+			cm_setup(index, 1, type);
+			spinlock_release(&coremap_lock);
+		}
+	}
+	if (index == CM_NONE && CURCPU_EXISTS()) {
+		index = pagecache_get(type);
+		if (index == CM_NONE) {
+			kheap_reclaim();
+			pagecache_reclaim();
+		}
+	}
+	if (index != CM_NONE) {
+		paddr = (coremap_start + index) * PAGE_SIZE;
+	} else if (free_places >= 1) {
+		spinlock_acquire(&coremap_lock);
+		index = cm_take_block(0);
+		if (index != CM_NONE)
+			paddr = cm_claim(index, 1, type);
+		spinlock_release(&coremap_lock);
+	}
+	/* the zero pool is free memory too */
+	if (paddr == 0 && (flags & PAGE_NOZERO) && CURCPU_EXISTS()) {
+		index = zeropool_get();
+		if (index != CM_NONE) {
+			spinlock_acquire(&coremap_lock);
+			cm_setup(index, 1, type);
+			spinlock_release(&coremap_lock);
+			paddr = (coremap_start + index) * PAGE_SIZE;
+		}
+	}
+	/* out of memory: page something out, if we are allowed to sleep */
+	if (paddr == 0 && can_page_out()) {
+		index = evict_page();
+		if (index != CM_NONE) {
+			spinlock_acquire(&coremap_lock);
+			cm_setup(index, 1, type);
+			spinlock_release(&coremap_lock);
+			paddr = (coremap_start + index) * PAGE_SIZE;
+		}
+	}
+	if (paddr != 0) {
+		struct cm_listing *cm = &coremap[paddr / PAGE_SIZE - coremap_start];
+		if (!(flags & PAGE_NOZERO) && !cm->zeroed)
+			bzero((void *) PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		cm->zeroed = false;
+	}
+	vm_pressure_update();
+	return paddr;
+}